@@ -12,17 +12,38 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <functional>
 #include <map>
+#include <numeric>
+#include <random>
+#include <mutex>
 #include <set>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
 #include <sys/time.h>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "gflags/gflags.h"
 #include "cppbtree/btree_map.h"
 #include "cppbtree/btree_set.h"
@@ -33,6 +54,89 @@ DEFINE_int32(benchmark_max_iters, 10000000, "Maximum test iterations");
 DEFINE_int32(benchmark_min_iters, 100, "Minimum test iterations");
 DEFINE_int32(benchmark_target_seconds, 1,
 	     "Attempt to benchmark for this many seconds");
+DEFINE_string(benchmark_key_distribution, "uniform",
+              "The keys used by the BM_* benchmarks: uniform (distinct keys "
+              "in random order), zipfian (keys drawn with replacement with "
+              "theta 0.99, popular keys scattered over the key space), "
+              "clustered (ascending runs in --benchmark_key_clusters "
+              "clusters written in random order), sequential (ascending) or "
+              "jitter (ascending, each key up to --benchmark_key_jitter "
+              "positions early)");
+DEFINE_int32(benchmark_key_clusters, 16,
+             "The number of clusters of the clustered key distribution");
+DEFINE_int32(benchmark_key_jitter, 16,
+             "The largest displacement of the jitter key distribution");
+DEFINE_int32(benchmark_key_prefix_len, 0,
+             "The length of a prefix shared by all string keys");
+DEFINE_string(benchmark_string_keys, "digits",
+              "The string keys used by the BM_* benchmarks: digits (short "
+              "decimal strings), url (URLs) or composite (composite "
+              "identifiers)");
+DEFINE_int32(benchmark_string_prefixes, 16,
+             "The number of distinct prefixes shared by url and composite "
+             "string keys");
+DEFINE_int32(benchmark_string_min_len, 20,
+             "The shortest length url and composite string keys are padded "
+             "to");
+DEFINE_int32(benchmark_string_max_len, 120,
+             "The longest length url and composite string keys are padded "
+             "to");
+DEFINE_string(benchmark_workload, "",
+              "Replay a YCSB-style workload instead of running the BM_* "
+              "benchmarks: one of a-f (the YCSB core workloads), 'all', or "
+              "a spec such as 'read=0.9,insert=0.1,dist=zipfian,scan_len=100' "
+              "with proportions for read, update, insert, scan, erase and "
+              "rmw (read-modify-write)");
+DEFINE_string(benchmark_trace, "",
+              "Replay the operations in this file instead of running the "
+              "BM_* benchmarks. Each line is '<op> <key> [<scan length>]' "
+              "where op is one of read, update, insert, scan, erase or rmw");
+DEFINE_int32(benchmark_workload_records, 1000000,
+             "The number of records loaded before a workload is replayed");
+DEFINE_int32(benchmark_workload_ops, 1000000,
+             "The number of operations in a generated workload");
+DEFINE_int32(benchmark_threads, 0,
+             "Run the multi-threaded read-scaling benchmarks with 1 up to "
+             "this many threads instead of the BM_* benchmarks");
+DEFINE_int32(benchmark_threads_records, 1000000,
+             "The number of records in the tree shared by the threads");
+DEFINE_int32(benchmark_threads_ops, 1000000,
+             "The number of operations performed by each thread");
+DEFINE_double(benchmark_threads_write_fraction, 0.01,
+              "The fraction of operations which are writes in the "
+              "reader/writer benchmark");
+DEFINE_int64(benchmark_churn_ops, 0,
+             "Run the churn benchmarks for this many erase/insert pairs per "
+             "pattern instead of the BM_* benchmarks");
+DEFINE_int32(benchmark_churn_values, 1000000,
+             "The number of elements in the trees of the churn benchmarks");
+DEFINE_int64(benchmark_churn_interval, 0,
+             "The number of churn operations between samples of the tree "
+             "shape, or 0 for 20 samples per run");
+DEFINE_int64(benchmark_dram_values, 0,
+             "Run the out-of-cache benchmarks on trees of this many elements "
+             "(e.g. 10^7 to 10^9) instead of the BM_* benchmarks");
+DEFINE_int64(benchmark_dram_probes, 10000000,
+             "The number of random probes in each out-of-cache benchmark");
+DEFINE_bool(benchmark_dram_flush_caches, true,
+            "Flush the CPU caches between the phases of the out-of-cache "
+            "benchmarks");
+DEFINE_int32(benchmark_latency_batch, 1,
+             "The number of workload operations timed together. Latency "
+             "percentiles per operation type are only reported for 1");
+DEFINE_int32(benchmark_soak_seconds, 0,
+             "Replay each workload repeatedly for this many seconds, "
+             "reporting latency percentiles periodically");
+DEFINE_int32(benchmark_soak_interval_seconds, 10,
+             "The period of the latency reports in soak mode");
+DEFINE_int32(benchmark_small_values, 64,
+             "The number of values in each tree built by the smallinsert "
+             "benchmarks");
+DEFINE_bool(benchmark_allocation_counts, true,
+            "Report allocations, frees and allocated bytes per operation");
+DEFINE_bool(benchmark_perf_counters, true,
+            "Report hardware performance counters per operation, where "
+            "perf_event_open() is available");
 
 using std::allocator;
 using std::less;
@@ -43,6 +147,10 @@ using std::multimap;
 using std::multiset;
 using std::set;
 using std::string;
+using std::unordered_map;
+using std::unordered_multimap;
+using std::unordered_multiset;
+using std::unordered_set;
 using std::vector;
 
 namespace btree {
@@ -58,6 +166,239 @@ struct RandGen {
   }
 };
 
+// Hardware performance counters read through perf_event_open(2), counting
+// only while the benchmark timer runs. Counters which cannot be opened (no
+// PMU in a VM, a restrictive perf_event_paranoid, a non-Linux host) are
+// skipped; the counters which are open are multiplexed by the kernel if need
+// be and their values scaled accordingly.
+class PerfCounters {
+ public:
+  enum {
+    kL1DMisses,
+    kLLCMisses,
+    kBranchMisses,
+    kDTLBMisses,
+    kInstructions,
+    kNumCounters,
+  };
+
+  PerfCounters();
+  ~PerfCounters();
+
+  // Returns true if any counter could be opened.
+  bool available() const;
+  // Returns true if counter i could be opened.
+  bool available(int i) const { return fds_[i] >= 0; }
+
+  void Start();
+  void Stop();
+  void Reset();
+
+  // Returns the value of counter i accumulated while started.
+  double Value(int i) const;
+
+  static const char* Name(int i);
+
+ private:
+  int fds_[kNumCounters];
+};
+
+#ifdef __linux__
+
+int OpenPerfCounter(uint32_t type, uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t CacheMissConfig(uint64_t cache) {
+  return cache |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+PerfCounters::PerfCounters() {
+  fds_[kL1DMisses] = OpenPerfCounter(
+      PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_L1D));
+  fds_[kLLCMisses] = OpenPerfCounter(
+      PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_LL));
+  fds_[kBranchMisses] = OpenPerfCounter(
+      PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  fds_[kDTLBMisses] = OpenPerfCounter(
+      PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_DTLB));
+  fds_[kInstructions] = OpenPerfCounter(
+      PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+}
+
+PerfCounters::~PerfCounters() {
+  for (int i = 0; i < kNumCounters; ++i) {
+    if (fds_[i] >= 0) {
+      close(fds_[i]);
+    }
+  }
+}
+
+void PerfCounters::Start() {
+  for (int i = 0; i < kNumCounters; ++i) {
+    if (fds_[i] >= 0) {
+      ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void PerfCounters::Stop() {
+  for (int i = 0; i < kNumCounters; ++i) {
+    if (fds_[i] >= 0) {
+      ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+void PerfCounters::Reset() {
+  for (int i = 0; i < kNumCounters; ++i) {
+    if (fds_[i] >= 0) {
+      ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+    }
+  }
+}
+
+double PerfCounters::Value(int i) const {
+  // The layout given by PERF_FORMAT_TOTAL_TIME_{ENABLED,RUNNING}.
+  struct {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+  } data;
+  if (fds_[i] < 0 || read(fds_[i], &data, sizeof(data)) != sizeof(data) ||
+      data.time_running == 0) {
+    return 0;
+  }
+  return double(data.value) * data.time_enabled / data.time_running;
+}
+
+#else  // !__linux__
+
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < kNumCounters; ++i) {
+    fds_[i] = -1;
+  }
+}
+PerfCounters::~PerfCounters() {}
+void PerfCounters::Start() {}
+void PerfCounters::Stop() {}
+void PerfCounters::Reset() {}
+double PerfCounters::Value(int i) const { return 0; }
+
+#endif  // __linux__
+
+bool PerfCounters::available() const {
+  for (int i = 0; i < kNumCounters; ++i) {
+    if (available(i)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* PerfCounters::Name(int i) {
+  static const char* const kNames[kNumCounters] = {
+    "l1d_miss", "llc_miss", "br_miss", "dtlb_miss", "insn",
+  };
+  return kNames[i];
+}
+
+// The counters shared by all benchmark runs, or NULL if disabled.
+PerfCounters *perf_counters;
+
+// Prints the available counters divided by ops, continuing a result line.
+void PrintPerfCounters(int64_t ops) {
+  if (perf_counters) {
+    for (int i = 0; i < PerfCounters::kNumCounters; ++i) {
+      if (perf_counters->available(i)) {
+        fprintf(stdout, "\t%s=%.2f", PerfCounters::Name(i),
+                perf_counters->Value(i) / ops);
+      }
+    }
+  }
+}
+
+// The allocations made through CountingAllocator. The counts are not
+// synchronized: the multi-threaded benchmarks only allocate while holding
+// an exclusive lock.
+struct AllocationCounts {
+  AllocationCounts()
+      : allocs(0),
+        frees(0),
+        bytes(0) {
+  }
+
+  int64_t allocs;
+  int64_t frees;
+  int64_t bytes;
+};
+
+AllocationCounts allocation_counts;
+
+// An STL allocator which counts allocations, frees and allocated bytes in
+// allocation_counts. All of the benchmarked containers use it.
+template <typename T>
+class CountingAllocator {
+ public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef CountingAllocator<U> other;
+  };
+
+  CountingAllocator() {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  pointer allocate(size_type n, const void *hint = 0) {
+    ++allocation_counts.allocs;
+    allocation_counts.bytes += n * sizeof(T);
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type n) {
+    ++allocation_counts.frees;
+    ::operator delete(p);
+  }
+  size_type max_size() const {
+    return size_type(-1) / sizeof(T);
+  }
+  void construct(pointer p, const T &v) {
+    new (p) T(v);
+  }
+  void destroy(pointer p) {
+    p->~T();
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+  return false;
+}
+
 struct BenchmarkRun {
   BenchmarkRun(const char *name, void (*func)(int));
   void Run();
@@ -70,6 +411,9 @@ struct BenchmarkRun {
   void (*benchmark_func)(int);
   int64_t accum_micros;
   int64_t last_started;
+  // The allocations made while timing was started.
+  AllocationCounts accum_allocations;
+  AllocationCounts last_allocations;
 };
 
 BenchmarkRun *first_benchmark;
@@ -115,19 +459,34 @@ void RunBenchmarks() {
 void BenchmarkRun::Start() {
   assert(!last_started);
   last_started = get_micros();
+  last_allocations = allocation_counts;
+  if (perf_counters) {
+    perf_counters->Start();
+  }
 }
 
 void BenchmarkRun::Stop() {
   if (last_started == 0) {
     return;
   }
+  if (perf_counters) {
+    perf_counters->Stop();
+  }
   accum_micros += get_micros() - last_started;
+  accum_allocations.allocs +=
+      allocation_counts.allocs - last_allocations.allocs;
+  accum_allocations.frees += allocation_counts.frees - last_allocations.frees;
+  accum_allocations.bytes += allocation_counts.bytes - last_allocations.bytes;
   last_started = 0;
 }
 
 void BenchmarkRun::Reset() {
   last_started = 0;
   accum_micros = 0;
+  accum_allocations = AllocationCounts();
+  if (perf_counters) {
+    perf_counters->Reset();
+  }
 }
 
 void BenchmarkRun::Run() {
@@ -150,13 +509,218 @@ void BenchmarkRun::Run() {
     }
     iters = min(iters, FLAGS_benchmark_max_iters);
   }
-  fprintf(stdout, "%s\t%ld\t%d\n", 
+  fprintf(stdout, "%s\t%ld\t%d", 
 	  benchmark_name, 
 	  accum_micros * 1000 / iters, 
 	  iters);
+  if (FLAGS_benchmark_allocation_counts) {
+    fprintf(stdout, "\tallocs_per_op=%.3f\tfrees_per_op=%.3f"
+            "\tbytes_per_op=%.1f",
+            double(accum_allocations.allocs) / iters,
+            double(accum_allocations.frees) / iters,
+            double(accum_allocations.bytes) / iters);
+  }
+  PrintPerfCounters(iters);
+  fprintf(stdout, "\n");
   current_benchmark = NULL;
 }
 
+// Draws from a zipfian distribution over [0, n) in which item 0 is the most
+// popular, using the method of Gray et al, "Quickly Generating
+// Billion-Record Synthetic Databases" as YCSB does.
+class ZipfianGenerator {
+ public:
+  ZipfianGenerator(int64_t n, double theta = 0.99)
+      : n_(n),
+        theta_(theta),
+        zeta2_(Zeta(2, theta)),
+        zetan_(Zeta(n, theta)),
+        alpha_(1 / (1 - theta)),
+        eta_((1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2_ / zetan_)) {
+  }
+
+  template <typename RNG>
+  int64_t operator()(RNG &rng) {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan_;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < 1 + pow(0.5, theta_)) {
+      return 1;
+    }
+    return std::min<int64_t>(
+        n_ - 1, int64_t(n_ * pow(eta_ * u - eta_ + 1, alpha_)));
+  }
+
+ private:
+  static double Zeta(int64_t n, double theta) {
+    double sum = 0;
+    for (int64_t i = 1; i <= n; ++i) {
+      sum += 1 / pow(double(i), theta);
+    }
+    return sum;
+  }
+
+  int64_t n_;
+  double theta_;
+  double zeta2_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+// Returns n integer keys in [0, maxval] in the order given by
+// --benchmark_key_distribution. Only the zipfian distribution repeats keys.
+vector<int> GenerateKeyNumbers(int n, int maxval) {
+  const string &dist = FLAGS_benchmark_key_distribution;
+  if (dist == "uniform") {
+    return GenerateNumbers(n, maxval);
+  }
+
+  std::mt19937_64 rng(FLAGS_test_random_seed);
+  vector<int> keys(n);
+  if (dist == "zipfian") {
+    // Popular keys are scattered over the key space rather than adjacent.
+    const vector<int> &scattered = GenerateNumbers(n, maxval);
+    ZipfianGenerator zipf(n);
+    for (int i = 0; i < n; ++i) {
+      keys[i] = scattered[zipf(rng)];
+    }
+  } else if (dist == "clustered") {
+    // Ascending runs of adjacent keys in a number of clusters spread over
+    // the key space, with the clusters written to in random order.
+    int clusters = max(1, min(FLAGS_benchmark_key_clusters, n));
+    int cluster_size = maxval / clusters;
+    vector<int> next(clusters, 0);
+    std::uniform_int_distribution<int> cluster_dist(0, clusters - 1);
+    for (int i = 0; i < n; ++i) {
+      int c = cluster_dist(rng);
+      while (next[c] >= cluster_size) {
+        c = (c + 1) % clusters;
+      }
+      keys[i] = c * cluster_size + next[c]++;
+    }
+  } else {
+    // Ascending keys, leaving gaps between them as GenerateNumbers() does.
+    int stride = max(1, maxval / max(n, 1));
+    for (int i = 0; i < n; ++i) {
+      keys[i] = i * stride;
+    }
+    if (dist == "jitter") {
+      // Each key arrives up to FLAGS_benchmark_key_jitter positions early.
+      std::uniform_int_distribution<int> jitter_dist(
+          0, max(0, FLAGS_benchmark_key_jitter));
+      for (int i = 0; i < n; ++i) {
+        std::swap(keys[i], keys[min(n - 1, i + jitter_dist(rng))]);
+      }
+    }
+  }
+  return keys;
+}
+
+// Returns the i-th string key in [0, maxval] of the kind given by
+// --benchmark_string_keys. Keys other than digits start with one of
+// FLAGS_benchmark_string_prefixes shared prefixes, followed by the digits of
+// i, and are padded to a length drawn uniformly from
+// [FLAGS_benchmark_string_min_len, FLAGS_benchmark_string_max_len]. Keys
+// with the same prefix are in the order of i.
+string MakeStringKey(int i, int maxval) {
+  char digits[16];
+  const string &kind = FLAGS_benchmark_string_keys;
+  if (kind == "digits") {
+    return GenerateDigits(digits, i, maxval);
+  }
+
+  // SplitMix64, so that the prefix and length of key i are deterministic.
+  uint64_t h = uint64_t(i) + 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+
+  int prefix = int(h % max(1, FLAGS_benchmark_string_prefixes));
+  char buf[64];
+  if (kind == "url") {
+    snprintf(buf, sizeof(buf), "https://www.example-%03d.com/api/v2/objects/",
+             prefix);
+  } else {
+    snprintf(buf, sizeof(buf), "tenant-%06d:collection-%04d:",
+             prefix, prefix * 7919 % 10000);
+  }
+  string key(buf);
+  key += GenerateDigits(digits, i, maxval);
+
+  int min_len = max(0, FLAGS_benchmark_string_min_len);
+  int max_len = max(min_len, FLAGS_benchmark_string_max_len);
+  size_t len = min_len + (h >> 32) % (max_len - min_len + 1);
+  if (key.size() < len) {
+    key += '/';
+  }
+  while (key.size() < len) {
+    h = h * 6364136223846793005ULL + 1442695040888963407ULL;
+    key += char('a' + (h >> 59) % 26);
+  }
+  return key;
+}
+
+// Generator with string keys following --benchmark_string_keys and
+// --benchmark_key_prefix_len.
+template <typename V>
+struct BenchmarkGenerator {
+  Generator<V> gen;
+  BenchmarkGenerator(int m)
+      : gen(m) {
+  }
+  V operator()(int i) const {
+    return gen(i);
+  }
+};
+
+template <>
+struct BenchmarkGenerator<string> {
+  int maxval;
+  BenchmarkGenerator(int m)
+      : maxval(m) {
+  }
+  string operator()(int i) const {
+    string key = MakeStringKey(i, maxval);
+    if (FLAGS_benchmark_key_prefix_len > 0) {
+      key.insert(0, string(FLAGS_benchmark_key_prefix_len, 'k'));
+    }
+    return key;
+  }
+};
+
+template <typename T, typename U>
+struct BenchmarkGenerator<std::pair<T, U> > {
+  BenchmarkGenerator<typename std::remove_const<T>::type> tgen;
+  BenchmarkGenerator<typename std::remove_const<U>::type> ugen;
+
+  BenchmarkGenerator(int m)
+      : tgen(m),
+        ugen(m) {
+  }
+  std::pair<T, U> operator()(int i) const {
+    return std::make_pair(tgen(i), ugen(i));
+  }
+};
+
+// GenerateValues() with the keys following --benchmark_key_distribution.
+template <typename V>
+vector<V> GenerateBenchmarkValues(int n) {
+  int two_times_max = 2 * max(FLAGS_benchmark_values, FLAGS_test_values);
+  int four_times_max = 2 * two_times_max;
+  const vector<int> &nums = GenerateKeyNumbers(n, four_times_max);
+  BenchmarkGenerator<V> gen(four_times_max);
+  vector<V> vec;
+
+  for (int i = 0; i < n; i++) {
+    vec.push_back(gen(nums[i]));
+  }
+
+  return vec;
+}
+
 // Used to avoid compiler optimizations for these benchmarks.
 template <typename T>
 void sink(const T& t0) {
@@ -173,7 +737,7 @@ void BM_Insert(int n) {
   StopBenchmarkTiming();
 
   T container;
-  vector<V> values = GenerateValues<V>(FLAGS_benchmark_values);
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
   for (int i = 0; i < values.size(); i++) {
     container.insert(values[i]);
   }
@@ -210,7 +774,7 @@ void BM_Lookup(int n) {
   StopBenchmarkTiming();
 
   T container;
-  vector<V> values = GenerateValues<V>(FLAGS_benchmark_values);
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
 
   for (int i = 0; i < values.size(); i++) {
     container.insert(values[i]);
@@ -242,7 +806,7 @@ void BM_FullLookup(int n) {
   StopBenchmarkTiming();
 
   T container;
-  vector<V> values = GenerateValues<V>(FLAGS_benchmark_values);
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
   vector<V> sorted(values);
   sort(sorted.begin(), sorted.end());
 
@@ -264,6 +828,40 @@ void BM_FullLookup(int n) {
   sink(r); // Keep compiler from optimizing away r.
 }
 
+// Benchmark lookup of values in a btree frozen by freeze(), for comparison
+// with BM_FullLookup.
+template <typename T>
+void BM_FrozenLookup(int n) {
+  typedef typename std::remove_const<typename T::value_type>::type V;
+  typename KeyOfValue<typename T::key_type, V>::type key_of_value;
+
+  // Disable timing while we perform some initialization.
+  StopBenchmarkTiming();
+
+  typename T::frozen_type frozen;
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
+  {
+    T container;
+    for (int i = 0; i < values.size(); i++) {
+      container.insert(values[i]);
+    }
+    frozen = container.freeze();
+  }
+
+  V r = V();
+
+  StartBenchmarkTiming();
+
+  for (int i = 0; i < n; i++) {
+    int m = i % values.size();
+    r = *frozen.find(key_of_value(values[m]));
+  }
+
+  StopBenchmarkTiming();
+
+  sink(r); // Keep compiler from optimizing away r.
+}
+
 // Benchmark deletion of values from a container.
 template <typename T>
 void BM_Delete(int n) {
@@ -274,7 +872,7 @@ void BM_Delete(int n) {
   StopBenchmarkTiming();
 
   T container;
-  vector<V> values = GenerateValues<V>(FLAGS_benchmark_values);
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
   for (int i = 0; i < values.size(); i++) {
     container.insert(values[i]);
   }
@@ -332,7 +930,8 @@ void BM_QueueAddRem(int n) {
   random_shuffle(remove_keys.begin(), remove_keys.end(), rand);
   random_shuffle(add_keys.begin(), add_keys.end(), rand);
 
-  Generator<V> g(FLAGS_benchmark_values + FLAGS_benchmark_max_iters);
+  BenchmarkGenerator<V> g(
+      FLAGS_benchmark_values + FLAGS_benchmark_max_iters);
 
   for (int i = 0; i < half; i++) {
     container.insert(g(add_keys[i]));
@@ -379,7 +978,7 @@ void BM_MixedAddRem(int n) {
   T container;
   RandGen rand(FLAGS_test_random_seed);
 
-  vector<V> values = GenerateValues<V>(FLAGS_benchmark_values * 2);
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values * 2);
 
   // Create two random shuffles
   vector<int> remove_keys(FLAGS_benchmark_values);
@@ -427,7 +1026,8 @@ void BM_Fifo(int n) {
   StopBenchmarkTiming();
 
   T container;
-  Generator<V> g(FLAGS_benchmark_values + FLAGS_benchmark_max_iters);
+  BenchmarkGenerator<V> g(
+      FLAGS_benchmark_values + FLAGS_benchmark_max_iters);
 
   for (int i = 0; i < FLAGS_benchmark_values; i++) {
     container.insert(g(i));
@@ -452,12 +1052,14 @@ void BM_FwdIter(int n) {
   StopBenchmarkTiming();
 
   T container;
-  vector<V> values = GenerateValues<V>(FLAGS_benchmark_values);
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
 
   for (int i = 0; i < FLAGS_benchmark_values; i++) {
     container.insert(values[i]);
   }
 
+  // Keys may repeat, depending on --benchmark_key_distribution.
+  const int size = container.size();
   typename T::iterator iter;
 
   V r = V();
@@ -465,7 +1067,7 @@ void BM_FwdIter(int n) {
   StartBenchmarkTiming();
 
   for (int i = 0; i < n; i++) {
-    int idx = i % FLAGS_benchmark_values;
+    int idx = i % size;
 
     if (idx == 0) {
       iter = container.begin();
@@ -479,30 +1081,653 @@ void BM_FwdIter(int n) {
   sink(r); // Keep compiler from optimizing away r.
 }
 
-typedef set<int32_t> stl_set_int32;
-typedef set<int64_t> stl_set_int64;
-typedef set<string> stl_set_string;
+// Benchmark insertion into small containers, which are rebuilt from empty
+// every FLAGS_benchmark_small_values values. This covers the growth of the
+// root leaf before the first split.
+template <typename T>
+void BM_SmallInsert(int n) {
+  typedef typename std::remove_const<typename T::value_type>::type V;
+
+  // Disable timing while we perform some initialization.
+  StopBenchmarkTiming();
+
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_small_values);
+
+  for (int i = 0; i < n; ) {
+    int m = min(n - i, FLAGS_benchmark_small_values);
+
+    StartBenchmarkTiming();
+
+    {
+      T container;
+      for (int j = 0; j < m; j++) {
+        container.insert(values[j]);
+      }
+      // Destroying the container is not part of the insertions.
+      StopBenchmarkTiming();
+    }
+
+    i += m;
+  }
+}
+
+// Benchmark bulk construction of a container from a range of values in
+// random order. Each iteration accounts for one value.
+template <typename T>
+void BM_Build(int n) {
+  typedef typename std::remove_const<typename T::value_type>::type V;
+
+  // Disable timing while we perform some initialization.
+  StopBenchmarkTiming();
+
+  vector<V> values = GenerateBenchmarkValues<V>(FLAGS_benchmark_values);
+
+  for (int i = 0; i < n; ) {
+    int m = min(n - i, FLAGS_benchmark_values);
+
+    StartBenchmarkTiming();
+
+    {
+      T container(values.begin(), values.begin() + m);
+      sink(container.size());
+      // Destroying the container is not part of the build.
+      StopBenchmarkTiming();
+    }
+
+    i += m;
+  }
+}
+
+// A YCSB-style workload: a sequence of operations on int64 keys which is
+// replayed against a map. Workloads are either generated from a spec (the
+// mix of operation types, the key distribution and the maximum scan length)
+// or read from a trace file.
+struct WorkloadOp {
+  enum Type {
+    kRead,
+    kUpdate,
+    kInsert,
+    kScan,
+    kErase,
+    kReadModifyWrite,
+    kNumTypes,
+  };
+
+  Type type;
+  int64_t key;
+  int scan_len;
+};
+
+const char* const kWorkloadOpNames[WorkloadOp::kNumTypes] = {
+  "read", "update", "insert", "scan", "erase", "rmw",
+};
+
+struct WorkloadSpec {
+  WorkloadSpec()
+      : distribution("zipfian"),
+        max_scan_len(100) {
+    for (int i = 0; i < WorkloadOp::kNumTypes; ++i) {
+      proportions[i] = 0;
+    }
+  }
+
+  double proportions[WorkloadOp::kNumTypes];
+  // One of uniform, zipfian or latest.
+  string distribution;
+  // Scan lengths are uniform in [1, max_scan_len].
+  int max_scan_len;
+};
+
+struct Workload {
+  string name;
+  vector<WorkloadOp> ops;
+};
+
+// The key of the i-th record. Record keys are scattered over the key space
+// so that insertion order is not key order.
+int64_t WorkloadKey(int64_t i) {
+  uint64_t h = 14695981039346656037ULL;
+  for (int b = 0; b < 8; ++b) {
+    h = (h ^ ((i >> (8 * b)) & 0xff)) * 1099511628211ULL;
+  }
+  return int64_t(h >> 1);
+}
+
+// Returns the spec of a YCSB core workload, or parses a spec of the form
+// "read=0.5,update=0.5,dist=zipfian,scan_len=100". Returns false on error.
+bool ParseWorkloadSpec(const string &str, WorkloadSpec *spec) {
+  double *p = spec->proportions;
+  if (str == "a") {
+    p[WorkloadOp::kRead] = 0.5;
+    p[WorkloadOp::kUpdate] = 0.5;
+  } else if (str == "b") {
+    p[WorkloadOp::kRead] = 0.95;
+    p[WorkloadOp::kUpdate] = 0.05;
+  } else if (str == "c") {
+    p[WorkloadOp::kRead] = 1;
+  } else if (str == "d") {
+    p[WorkloadOp::kRead] = 0.95;
+    p[WorkloadOp::kInsert] = 0.05;
+    spec->distribution = "latest";
+  } else if (str == "e") {
+    p[WorkloadOp::kScan] = 0.95;
+    p[WorkloadOp::kInsert] = 0.05;
+  } else if (str == "f") {
+    p[WorkloadOp::kRead] = 0.5;
+    p[WorkloadOp::kReadModifyWrite] = 0.5;
+  } else {
+    std::istringstream in(str);
+    string field;
+    while (getline(in, field, ',')) {
+      size_t eq = field.find('=');
+      if (eq == string::npos) {
+        return false;
+      }
+      string name = field.substr(0, eq);
+      string value = field.substr(eq + 1);
+      if (name == "dist") {
+        spec->distribution = value;
+        continue;
+      }
+      if (name == "scan_len") {
+        spec->max_scan_len = std::max(1, atoi(value.c_str()));
+        continue;
+      }
+      int type = 0;
+      while (type < WorkloadOp::kNumTypes && name != kWorkloadOpNames[type]) {
+        ++type;
+      }
+      if (type == WorkloadOp::kNumTypes) {
+        return false;
+      }
+      p[type] = atof(value.c_str());
+    }
+  }
+  return spec->distribution == "uniform" ||
+      spec->distribution == "zipfian" ||
+      spec->distribution == "latest";
+}
+
+// Generates ops operations following spec against a store initially
+// holding records records.
+void GenerateWorkload(const WorkloadSpec &spec, int64_t records, int ops,
+                      Workload *workload) {
+  std::mt19937_64 rng(FLAGS_test_random_seed);
+  std::discrete_distribution<int> op_dist(
+      spec.proportions, spec.proportions + WorkloadOp::kNumTypes);
+  std::uniform_int_distribution<int> scan_dist(1, spec.max_scan_len);
+  // Keys are drawn from the records which exist when the operation is
+  // generated. The zipfian generator is sized for (more than) the final
+  // record count and draws which fall past the current count are rejected.
+  double total = std::accumulate(
+      spec.proportions, spec.proportions + WorkloadOp::kNumTypes, 0.0);
+  int64_t inserts =
+      int64_t(ops * spec.proportions[WorkloadOp::kInsert] / total);
+  ZipfianGenerator zipf(records + 2 * inserts + 1);
+
+  workload->ops.resize(ops);
+  for (int i = 0; i < ops; ++i) {
+    WorkloadOp &op = workload->ops[i];
+    op.type = WorkloadOp::Type(op_dist(rng));
+    op.scan_len = op.type == WorkloadOp::kScan ? scan_dist(rng) : 0;
+    if (op.type == WorkloadOp::kInsert) {
+      op.key = WorkloadKey(records++);
+      continue;
+    }
+    if (records == 0) {
+      // Nothing has been inserted yet: look for the first record.
+      op.key = WorkloadKey(0);
+      continue;
+    }
+    int64_t r;
+    if (spec.distribution == "uniform") {
+      r = std::uniform_int_distribution<int64_t>(0, records - 1)(rng);
+    } else {
+      do {
+        r = zipf(rng);
+      } while (r >= records);
+      if (spec.distribution == "latest") {
+        // The most recently inserted records are the most popular.
+        r = records - 1 - r;
+      } else {
+        // Scatter the popular records over the key space.
+        r = uint64_t(WorkloadKey(r)) % records;
+      }
+    }
+    op.key = WorkloadKey(r);
+  }
+}
+
+// Reads a workload from a trace file. Returns false on error.
+bool ReadWorkloadTrace(const string &path, Workload *workload) {
+  std::ifstream in(path.c_str());
+  if (!in) {
+    return false;
+  }
+  string line;
+  while (getline(in, line)) {
+    std::istringstream fields(line);
+    string name;
+    WorkloadOp op;
+    if (!(fields >> name)) {
+      continue;
+    }
+    if (!(fields >> op.key)) {
+      return false;
+    }
+    int type = 0;
+    while (type < WorkloadOp::kNumTypes && name != kWorkloadOpNames[type]) {
+      ++type;
+    }
+    if (type == WorkloadOp::kNumTypes) {
+      return false;
+    }
+    op.type = WorkloadOp::Type(type);
+    op.scan_len = 1;
+    fields >> op.scan_len;
+    workload->ops.push_back(op);
+  }
+  return true;
+}
+
+// A histogram of latencies in nanoseconds in the style of HdrHistogram:
+// each power of 2 is divided into kSubBuckets linear buckets, so recorded
+// values are reported with a relative error of at most 1/kSubBuckets.
+class LatencyHistogram {
+  enum {
+    kSubBucketBits = 5,
+    kSubBuckets = 1 << kSubBucketBits,
+    kNumBuckets = (66 - kSubBucketBits) * kSubBuckets,
+  };
+
+ public:
+  LatencyHistogram() {
+    Reset();
+  }
+
+  // Records count samples of value v.
+  void Record(int64_t v, int64_t count = 1) {
+    v = std::max<int64_t>(v, 0);
+    counts_[Index(v)] += count;
+    count_ += count;
+    sum_ += v * count;
+    max_ = std::max(max_, v);
+  }
+
+  void Reset() {
+    memset(counts_, 0, sizeof(counts_));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+  int64_t count() const { return count_; }
+  int64_t mean() const { return count_ ? sum_ / count_ : 0; }
+  int64_t max() const { return max_; }
+
+  // Returns the smallest recorded value which is at least the fraction p of
+  // the samples, rounded up to the end of its bucket.
+  int64_t Percentile(double p) const {
+    int64_t rank = std::max<int64_t>(1, int64_t(ceil(p * count_)));
+    int64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::min(max_, UpperBound(i));
+      }
+    }
+    return max_;
+  }
+
+  // Prints the percentiles as key=value fields.
+  void Print() const {
+    fprintf(stdout, "\tp50=%ld\tp99=%ld\tp999=%ld\tmax=%ld",
+            long(Percentile(0.5)), long(Percentile(0.99)),
+            long(Percentile(0.999)), long(max_));
+  }
+
+ private:
+  // Values below 2 * kSubBuckets have a bucket each. Above that, bucket b
+  // holds the values whose top kSubBucketBits + 1 bits are sub << b.
+  static int Index(int64_t v) {
+    int msb = 63 - __builtin_clzll(uint64_t(v) | 1);
+    int b = std::max(0, msb - kSubBucketBits);
+    return b * kSubBuckets + int(v >> b);
+  }
+  static int64_t UpperBound(int index) {
+    int b = std::max(0, index / kSubBuckets - 1);
+    int64_t sub = index - b * kSubBuckets;
+    return ((sub + 1) << b) - 1;
+  }
+
+  int64_t counts_[kNumBuckets];
+  int64_t count_;
+  int64_t sum_;
+  int64_t max_;
+};
+
+// Prints and resets the latencies of the soak mode interval ending elapsed
+// after the start of the replay.
+void PrintSoakInterval(const string &workload_name, const char *tree_name,
+                       std::chrono::steady_clock::duration elapsed,
+                       LatencyHistogram *interval) {
+  fprintf(stdout, "WL_%s_%s/soak:%lds\t%ld\t%ld",
+          workload_name.c_str(), tree_name,
+          long(std::chrono::duration_cast<std::chrono::seconds>(
+              elapsed).count()),
+          long(interval->mean()), long(interval->count()));
+  interval->Print();
+  fprintf(stdout, "\n");
+  fflush(stdout);
+  interval->Reset();
+}
+
+// Applies op, the i-th operation of a workload, to container.
+template <typename T>
+void ApplyWorkloadOp(const WorkloadOp &op, int64_t i, T *container,
+                     intptr_t *r) {
+  typedef typename T::mapped_type mapped_type;
+  switch (op.type) {
+    case WorkloadOp::kRead: {
+      typename T::const_iterator it = container->find(op.key);
+      if (it != container->end()) {
+        *r += it->second;
+      }
+      break;
+    }
+    case WorkloadOp::kUpdate: {
+      typename T::iterator it = container->find(op.key);
+      if (it != container->end()) {
+        it->second = mapped_type(i);
+      }
+      break;
+    }
+    case WorkloadOp::kInsert:
+      container->insert(std::make_pair(op.key, mapped_type(i)));
+      break;
+    case WorkloadOp::kScan: {
+      typename T::const_iterator it = container->lower_bound(op.key);
+      for (int j = 0; j < op.scan_len && it != container->end(); ++j, ++it) {
+        *r += it->second;
+      }
+      break;
+    }
+    case WorkloadOp::kErase:
+      container->erase(op.key);
+      break;
+    case WorkloadOp::kReadModifyWrite: {
+      typename T::iterator it = container->find(op.key);
+      if (it != container->end()) {
+        it->second = mapped_type(it->second + 1);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Replays a workload against a map type T after loading
+// FLAGS_benchmark_workload_records records, and reports the throughput and
+// the latency distribution of each operation type. Operations are timed in
+// batches of FLAGS_benchmark_latency_batch. In soak mode the workload is
+// replayed repeatedly for FLAGS_benchmark_soak_seconds, reporting the
+// latency distribution of each FLAGS_benchmark_soak_interval_seconds.
+template <typename T>
+void RunWorkload(const char *tree_name, const Workload &workload) {
+  typedef typename T::mapped_type mapped_type;
+  typedef std::chrono::steady_clock clock;
+
+  T container;
+  for (int i = 0; i < FLAGS_benchmark_workload_records; ++i) {
+    container.insert(std::make_pair(WorkloadKey(i), mapped_type(i)));
+  }
+  if (workload.ops.empty()) {
+    return;
+  }
+
+  const int64_t size = workload.ops.size();
+  const int batch = std::max(FLAGS_benchmark_latency_batch, 1);
+  const bool soak = FLAGS_benchmark_soak_seconds > 0;
+  const clock::duration soak_duration =
+      std::chrono::seconds(FLAGS_benchmark_soak_seconds);
+  const clock::duration soak_interval =
+      std::chrono::seconds(std::max(FLAGS_benchmark_soak_interval_seconds, 1));
+
+  LatencyHistogram histograms[WorkloadOp::kNumTypes];
+  LatencyHistogram all, interval;
+  int64_t ops = 0;
+  intptr_t r = 0;
+  if (perf_counters) {
+    perf_counters->Reset();
+    perf_counters->Start();
+  }
+  clock::time_point begin = clock::now();
+  clock::time_point last = begin;
+  clock::time_point interval_begin = begin;
+  while (soak ? last - begin < soak_duration : ops < size) {
+    int64_t n = soak ? batch : std::min<int64_t>(batch, size - ops);
+    for (int64_t j = 0; j < n; ++j) {
+      ApplyWorkloadOp(workload.ops[(ops + j) % size], ops + j, &container,
+                      &r);
+    }
+    clock::time_point now = clock::now();
+    int64_t nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - last)
+        .count();
+    if (n == 1) {
+      histograms[workload.ops[ops % size].type].Record(nanos);
+    }
+    all.Record(nanos / n, n);
+    if (soak) {
+      interval.Record(nanos / n, n);
+      if (now - interval_begin >= soak_interval) {
+        PrintSoakInterval(workload.name, tree_name, now - begin, &interval);
+        interval_begin = now;
+      }
+    }
+    last = now;
+    ops += n;
+  }
+  if (interval.count() > 0) {
+    PrintSoakInterval(workload.name, tree_name, last - begin, &interval);
+  }
+  if (perf_counters) {
+    perf_counters->Stop();
+  }
+  sink(r);
+
+  double seconds = std::chrono::duration<double>(last - begin).count();
+  fprintf(stdout, "WL_%s_%s\t%ld\t%ld\tops_per_sec=%.0f",
+          workload.name.c_str(), tree_name,
+          long(seconds * 1e9 / ops), long(ops), ops / seconds);
+  all.Print();
+  PrintPerfCounters(ops);
+  fprintf(stdout, "\n");
+  for (int i = 0; i < WorkloadOp::kNumTypes; ++i) {
+    if (histograms[i].count() > 0) {
+      fprintf(stdout, "WL_%s_%s/%s\t%ld\t%ld",
+              workload.name.c_str(), tree_name, kWorkloadOpNames[i],
+              long(histograms[i].mean()), long(histograms[i].count()));
+      histograms[i].Print();
+      fprintf(stdout, "\n");
+    }
+  }
+}
+
+// A sorted std::vector used as a baseline for read-mostly data: lookups
+// binary search the vector and every insertion or erasure shifts the values
+// after it. Bulk construction appends the values and sorts them once. Multi
+// selects multiset/multimap semantics.
+template <typename Key, typename Value, bool Multi>
+class sorted_vector {
+  typedef vector<Value, CountingAllocator<Value> > storage_type;
+  typedef typename KeyOfValue<Key, Value>::type key_of_value;
+
+  struct value_less {
+    bool operator()(const Value &a, const Value &b) const {
+      return key_of_value()(a) < key_of_value()(b);
+    }
+  };
+  struct value_less_key {
+    bool operator()(const Value &a, const Key &b) const {
+      return key_of_value()(a) < b;
+    }
+  };
+  struct key_less_value {
+    bool operator()(const Key &a, const Value &b) const {
+      return a < key_of_value()(b);
+    }
+  };
+
+ public:
+  typedef Key key_type;
+  typedef Value value_type;
+  typedef typename storage_type::iterator iterator;
+  typedef typename storage_type::const_iterator const_iterator;
+  typedef typename storage_type::size_type size_type;
+
+  sorted_vector() {}
+  template <typename InputIterator>
+  sorted_vector(InputIterator b, InputIterator e)
+      : values_(b, e) {
+    std::stable_sort(values_.begin(), values_.end(), value_less());
+    if (!Multi) {
+      values_.erase(std::unique(values_.begin(), values_.end(), equivalent),
+                    values_.end());
+    }
+  }
 
-typedef map<int32_t, intptr_t> stl_map_int32;
-typedef map<int64_t, intptr_t> stl_map_int64;
-typedef map<string, intptr_t> stl_map_string;
+  iterator begin() { return values_.begin(); }
+  const_iterator begin() const { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator end() const { return values_.end(); }
+  size_type size() const { return values_.size(); }
 
-typedef multiset<int32_t> stl_multiset_int32;
-typedef multiset<int64_t> stl_multiset_int64;
-typedef multiset<string> stl_multiset_string;
+  iterator lower_bound(const key_type &key) {
+    return std::lower_bound(begin(), end(), key, value_less_key());
+  }
+  const_iterator lower_bound(const key_type &key) const {
+    return std::lower_bound(begin(), end(), key, value_less_key());
+  }
+  iterator upper_bound(const key_type &key) {
+    return std::upper_bound(begin(), end(), key, key_less_value());
+  }
+  iterator find(const key_type &key) {
+    iterator it = lower_bound(key);
+    return it != end() && !key_less_value()(key, *it) ? it : end();
+  }
+  const_iterator find(const key_type &key) const {
+    const_iterator it = lower_bound(key);
+    return it != end() && !key_less_value()(key, *it) ? it : end();
+  }
+
+  // Inserts v after any equivalent values. Returns the position of v, or of
+  // the equivalent value which prevented its insertion.
+  iterator insert(const value_type &v) {
+    const key_type &key = key_of_value()(v);
+    iterator it = Multi ? upper_bound(key) : lower_bound(key);
+    if (!Multi && it != end() && !key_less_value()(key, *it)) {
+      return it;
+    }
+    return values_.insert(it, v);
+  }
+  // Inserts v before position if that keeps the values sorted, and as
+  // insert(v) otherwise.
+  iterator insert(iterator position, const value_type &v) {
+    value_less less;
+    bool fits_before = position == end() ||
+        (Multi ? !less(*position, v) : less(v, *position));
+    bool fits_after = position == begin() ||
+        (Multi ? !less(v, *(position - 1)) : less(*(position - 1), v));
+    if (fits_before && fits_after) {
+      return values_.insert(position, v);
+    }
+    return insert(v);
+  }
+
+  size_type erase(const key_type &key) {
+    iterator first = lower_bound(key);
+    iterator last = upper_bound(key);
+    size_type count = last - first;
+    values_.erase(first, last);
+    return count;
+  }
+  iterator erase(iterator position) {
+    return values_.erase(position);
+  }
+
+ private:
+  static bool equivalent(const Value &a, const Value &b) {
+    return !value_less()(a, b) && !value_less()(b, a);
+  }
 
-typedef multimap<int32_t, intptr_t> stl_multimap_int32;
-typedef multimap<int64_t, intptr_t> stl_multimap_int64;
-typedef multimap<string, intptr_t> stl_multimap_string;
+  storage_type values_;
+};
 
-#define MY_BENCHMARK_TYPES2(value, name, size)                                \
-  typedef btree ## _set<value, less<value>, allocator<value>, size>           \
-    btree ## _ ## size ## _set_ ## name;                                      \
-  typedef btree ## _map<value, int, less<value>, allocator<value>, size>      \
-    btree ## _ ## size ## _map_ ## name;                                      \
-  typedef btree ## _multiset<value, less<value>, allocator<value>, size>      \
-    btree ## _ ## size ## _multiset_ ## name;                                 \
-  typedef btree ## _multimap<value, int, less<value>, allocator<value>, size> \
+#define MY_STL_TYPES(value, name)                                        \
+  typedef set<value, less<value>, CountingAllocator<value> >             \
+    stl_set_ ## name;                                                    \
+  typedef map<value, intptr_t, less<value>,                              \
+              CountingAllocator<std::pair<const value, intptr_t> > >     \
+    stl_map_ ## name;                                                    \
+  typedef multiset<value, less<value>, CountingAllocator<value> >        \
+    stl_multiset_ ## name;                                               \
+  typedef multimap<value, intptr_t, less<value>,                         \
+                   CountingAllocator<std::pair<const value, intptr_t> > > \
+    stl_multimap_ ## name
+
+MY_STL_TYPES(int32_t, int32);
+MY_STL_TYPES(int64_t, int64);
+MY_STL_TYPES(string, string);
+
+#define MY_HASH_TYPES(value, name)                                        \
+  typedef unordered_set<value, std::hash<value>, std::equal_to<value>,    \
+                        CountingAllocator<value> >                        \
+    hash_set_ ## name;                                                    \
+  typedef unordered_map<value, intptr_t, std::hash<value>,                \
+                        std::equal_to<value>,                             \
+                        CountingAllocator<std::pair<const value,          \
+                                                    intptr_t> > >         \
+    hash_map_ ## name;                                                    \
+  typedef unordered_multiset<value, std::hash<value>,                     \
+                             std::equal_to<value>,                        \
+                             CountingAllocator<value> >                   \
+    hash_multiset_ ## name;                                               \
+  typedef unordered_multimap<value, intptr_t, std::hash<value>,           \
+                             std::equal_to<value>,                        \
+                             CountingAllocator<std::pair<const value,     \
+                                                         intptr_t> > >    \
+    hash_multimap_ ## name
+
+MY_HASH_TYPES(int32_t, int32);
+MY_HASH_TYPES(int64_t, int64);
+MY_HASH_TYPES(string, string);
+
+#define MY_SORTED_VECTOR_TYPES(value, name)                              \
+  typedef sorted_vector<value, value, false> sorted_vector_set_ ## name; \
+  typedef sorted_vector<value, std::pair<value, intptr_t>, false>        \
+    sorted_vector_map_ ## name;                                          \
+  typedef sorted_vector<value, value, true>                              \
+    sorted_vector_multiset_ ## name;                                     \
+  typedef sorted_vector<value, std::pair<value, intptr_t>, true>         \
+    sorted_vector_multimap_ ## name
+
+MY_SORTED_VECTOR_TYPES(int32_t, int32);
+MY_SORTED_VECTOR_TYPES(int64_t, int64);
+MY_SORTED_VECTOR_TYPES(string, string);
+
+#define MY_BENCHMARK_TYPES2(value, name, size)                              \
+  typedef btree ## _set<value, less<value>, CountingAllocator<value>, size> \
+    btree ## _ ## size ## _set_ ## name;                                    \
+  typedef btree ## _map<value, int, less<value>, CountingAllocator<value>,  \
+                        size>                                               \
+    btree ## _ ## size ## _map_ ## name;                                    \
+  typedef btree ## _multiset<value, less<value>, CountingAllocator<value>,  \
+                             size>                                          \
+    btree ## _ ## size ## _multiset_ ## name;                               \
+  typedef btree ## _multimap<value, int, less<value>,                       \
+                             CountingAllocator<value>, size>                \
     btree ## _ ## size ## _multimap_ ## name
 
 #define MY_BENCHMARK_TYPES(value, name)  \
@@ -527,6 +1752,40 @@ MY_BENCHMARK_TYPES(int32_t, int32);
 MY_BENCHMARK_TYPES(int64_t, int64);
 MY_BENCHMARK_TYPES(string, string);
 
+// A string comparator which btree does not adapt to its compare-to
+// interface, so that searches use plain less-than comparisons.
+struct plain_string_less {
+  bool operator()(const string &a, const string &b) const {
+    return a < b;
+  }
+};
+
+#define MY_PLAIN_STRING_TYPES(size)                                        \
+  typedef btree_set<string, plain_string_less, CountingAllocator<string>, \
+                    size>                                                  \
+    btree_ ## size ## _plain_set_string;                                   \
+  typedef btree_map<string, int, plain_string_less,                        \
+                    CountingAllocator<string>, size>                       \
+    btree_ ## size ## _plain_map_string
+
+MY_PLAIN_STRING_TYPES(256);
+MY_PLAIN_STRING_TYPES(512);
+MY_PLAIN_STRING_TYPES(1024);
+MY_PLAIN_STRING_TYPES(2048);
+
+// Sets which search their nodes by interpolation; see
+// btree_interpolation_search_params.
+#define MY_INTERPOLATION_TYPES(value, name, size)                          \
+  typedef btree_unique_container<btree<btree_interpolation_search_params< \
+    btree_set_params<value, less<value>, CountingAllocator<value>,        \
+                     size> > > >                                          \
+    btree_ ## size ## _interpolation_set_ ## name
+
+MY_INTERPOLATION_TYPES(int32_t, int32, 1024);
+MY_INTERPOLATION_TYPES(int32_t, int32, 2048);
+MY_INTERPOLATION_TYPES(int64_t, int64, 1024);
+MY_INTERPOLATION_TYPES(int64_t, int64, 2048);
+
 #define MY_BENCHMARK4(type, name, func)                            \
   void BM_ ## type ## _ ## name(int n) { BM_ ## func <type>(n); }  \
   BTREE_BENCHMARK(BM_ ## type ## _ ## name)
@@ -557,8 +1816,12 @@ MY_BENCHMARK_TYPES(string, string);
   MY_BENCHMARK4(tree ## _2048_ ## type, name, func)
 #endif
 
-#define MY_BENCHMARK2(type, name, func)    \
-  MY_BENCHMARK4(stl_ ## type, name, func); \
+// Each btree is measured against std::set/std::map (stl_), the unordered
+// containers (hash_) and a sorted std::vector (sorted_vector_).
+#define MY_BENCHMARK2(type, name, func)              \
+  MY_BENCHMARK4(stl_ ## type, name, func);           \
+  MY_BENCHMARK4(hash_ ## type, name, func);          \
+  MY_BENCHMARK4(sorted_vector_ ## type, name, func); \
   MY_BENCHMARK3(btree, type, name, func)
 
 #define MY_BENCHMARK(type)                        \
@@ -569,7 +1832,9 @@ MY_BENCHMARK_TYPES(string, string);
   MY_BENCHMARK2(type, queueaddrem, QueueAddRem);  \
   MY_BENCHMARK2(type, mixedaddrem, MixedAddRem);  \
   MY_BENCHMARK2(type, fifo, Fifo);                \
-  MY_BENCHMARK2(type, fwditer, FwdIter)
+  MY_BENCHMARK2(type, fwditer, FwdIter);          \
+  MY_BENCHMARK2(type, build, Build);              \
+  MY_BENCHMARK2(type, smallinsert, SmallInsert)
 
 MY_BENCHMARK(set_int32);
 MY_BENCHMARK(map_int32);
@@ -585,10 +1850,577 @@ MY_BENCHMARK(multimap_int64);
 MY_BENCHMARK(multiset_string);
 MY_BENCHMARK(multimap_string);
 
+// String keys are where node size and the comparator matter most, so the
+// string sets and maps are also measured at intermediate node sizes and
+// with a plain comparator.
+#define MY_STRING_BENCHMARK3(type, name, func)       \
+  MY_BENCHMARK4(btree_256_ ## type, name, func);     \
+  MY_BENCHMARK4(btree_512_ ## type, name, func);     \
+  MY_BENCHMARK4(btree_1024_ ## type, name, func);    \
+  MY_BENCHMARK4(btree_2048_ ## type, name, func)
+
+#ifdef NODESIZE_TESTING
+#define MY_STRING_BENCHMARK2(type, name, func) \
+  MY_STRING_BENCHMARK3(plain_ ## type, name, func)
+#else
+#define MY_STRING_BENCHMARK2(type, name, func)     \
+  MY_BENCHMARK4(btree_512_ ## type, name, func);   \
+  MY_BENCHMARK4(btree_1024_ ## type, name, func);  \
+  MY_STRING_BENCHMARK3(plain_ ## type, name, func)
+#endif
+
+#define MY_STRING_BENCHMARK(type)                        \
+  MY_STRING_BENCHMARK2(type, insert, Insert);            \
+  MY_STRING_BENCHMARK2(type, lookup, Lookup);            \
+  MY_STRING_BENCHMARK2(type, fulllookup, FullLookup);    \
+  MY_STRING_BENCHMARK2(type, delete, Delete);            \
+  MY_STRING_BENCHMARK2(type, fwditer, FwdIter)
+
+MY_STRING_BENCHMARK(set_string);
+MY_STRING_BENCHMARK(map_string);
+
+// Frozen btrees are measured at the default node size only; the node size
+// does not affect their layout.
+#define MY_FROZEN_BENCHMARK(type) \
+  MY_BENCHMARK4(btree_256_ ## type, frozenlookup, FrozenLookup)
+
+MY_FROZEN_BENCHMARK(set_int32);
+MY_FROZEN_BENCHMARK(map_int32);
+MY_FROZEN_BENCHMARK(set_int64);
+MY_FROZEN_BENCHMARK(map_int64);
+MY_FROZEN_BENCHMARK(set_string);
+MY_FROZEN_BENCHMARK(map_string);
+
+// Interpolation search is measured at the large node sizes it targets, for
+// comparison with the plain btree_1024_ and btree_2048_ sets.
+#define MY_INTERPOLATION_BENCHMARK2(type, name, func)              \
+  MY_BENCHMARK4(btree_1024_interpolation_ ## type, name, func);    \
+  MY_BENCHMARK4(btree_2048_interpolation_ ## type, name, func)
+
+#define MY_INTERPOLATION_BENCHMARK(type)                     \
+  MY_INTERPOLATION_BENCHMARK2(type, insert, Insert);         \
+  MY_INTERPOLATION_BENCHMARK2(type, lookup, Lookup);         \
+  MY_INTERPOLATION_BENCHMARK2(type, fulllookup, FullLookup); \
+  MY_INTERPOLATION_BENCHMARK2(type, delete, Delete)
+
+MY_INTERPOLATION_BENCHMARK(set_int32);
+MY_INTERPOLATION_BENCHMARK(set_int64);
+
+struct WorkloadTarget {
+  const char *name;
+  void (*func)(const char *name, const Workload &workload);
+};
+
+#define MY_WORKLOAD_TARGET(type) { #type, RunWorkload<type> }
+
+const WorkloadTarget kWorkloadTargets[] = {
+  MY_WORKLOAD_TARGET(stl_map_int64),
+  MY_WORKLOAD_TARGET(btree_256_map_int64),
+  MY_WORKLOAD_TARGET(btree_512_map_int64),
+  MY_WORKLOAD_TARGET(btree_1024_map_int64),
+  MY_WORKLOAD_TARGET(btree_2048_map_int64),
+};
+
+void RunWorkloadTargets(const Workload &workload) {
+  for (size_t i = 0; i < sizeof(kWorkloadTargets) / sizeof(*kWorkloadTargets);
+       ++i) {
+    kWorkloadTargets[i].func(kWorkloadTargets[i].name, workload);
+  }
+}
+
+// Runs the workloads selected by --benchmark_workload or --benchmark_trace.
+// Returns false on error.
+bool RunWorkloads() {
+  if (!FLAGS_benchmark_trace.empty()) {
+    Workload workload;
+    workload.name = "trace";
+    if (!ReadWorkloadTrace(FLAGS_benchmark_trace, &workload)) {
+      fprintf(stderr, "Error reading trace %s\n",
+              FLAGS_benchmark_trace.c_str());
+      return false;
+    }
+    RunWorkloadTargets(workload);
+  }
+  if (!FLAGS_benchmark_workload.empty()) {
+    vector<string> specs;
+    if (FLAGS_benchmark_workload == "all") {
+      const char *kCoreWorkloads[] = { "a", "b", "c", "d", "e", "f" };
+      specs.assign(kCoreWorkloads, kCoreWorkloads + 6);
+    } else {
+      specs.push_back(FLAGS_benchmark_workload);
+    }
+    for (size_t i = 0; i < specs.size(); ++i) {
+      WorkloadSpec spec;
+      if (!ParseWorkloadSpec(specs[i], &spec)) {
+        fprintf(stderr, "Invalid workload %s\n", specs[i].c_str());
+        return false;
+      }
+      Workload workload;
+      workload.name = specs[i].size() == 1 ? "ycsb_" + specs[i] : "custom";
+      GenerateWorkload(spec, FLAGS_benchmark_workload_records,
+                       FLAGS_benchmark_workload_ops, &workload);
+      RunWorkloadTargets(workload);
+    }
+  }
+  return true;
+}
+
+// The multi-threaded benchmarks share one tree of
+// FLAGS_benchmark_threads_records records between 1 up to
+// FLAGS_benchmark_threads threads. The read-only kernels access the tree
+// without synchronization; the reader/writer kernel guards it with a
+// std::shared_mutex.
+enum ThreadsKernel {
+  kThreadsFind,
+  kThreadsLowerBound,
+  kThreadsScan,
+  kThreadsReadWrite,
+  kNumThreadsKernels,
+};
+
+const char* const kThreadsKernelNames[kNumThreadsKernels] = {
+  "find", "lower_bound", "scan", "rw_locked",
+};
+
+// The number of elements visited by each kThreadsScan operation.
+const int kThreadsScanLength = 16;
+
+// Performs the operations of one thread. Reads look up the keys in keys;
+// writes toggle the presence of the keys in write_keys.
+template <typename T>
+void ThreadsWorker(ThreadsKernel kernel, T *container,
+                   std::shared_mutex *mu, const vector<int64_t> &keys,
+                   const vector<int64_t> &write_keys,
+                   const std::atomic<bool> *go) {
+  typedef typename T::mapped_type mapped_type;
+  while (!go->load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+  const T &c = *container;
+  intptr_t r = 0;
+  size_t w = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    switch (kernel) {
+      case kThreadsFind: {
+        typename T::const_iterator it = c.find(keys[i]);
+        if (it != c.end()) {
+          r += it->second;
+        }
+        break;
+      }
+      case kThreadsLowerBound: {
+        typename T::const_iterator it = c.lower_bound(keys[i]);
+        if (it != c.end()) {
+          r += it->second;
+        }
+        break;
+      }
+      case kThreadsScan: {
+        typename T::const_iterator it = c.lower_bound(keys[i]);
+        for (int j = 0; j < kThreadsScanLength && it != c.end(); ++j, ++it) {
+          r += it->second;
+        }
+        break;
+      }
+      case kThreadsReadWrite: {
+        if (keys[i] < 0) {
+          // A write: insert the key if it is absent and erase it otherwise,
+          // so that the size of the tree stays roughly constant.
+          int64_t key = write_keys[w++ % write_keys.size()];
+          std::unique_lock<std::shared_mutex> lock(*mu);
+          if (container->erase(key) == 0) {
+            container->insert(std::make_pair(key, mapped_type(i)));
+          }
+        } else {
+          std::shared_lock<std::shared_mutex> lock(*mu);
+          typename T::const_iterator it = c.find(keys[i]);
+          if (it != c.end()) {
+            r += it->second;
+          }
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  sink(r);
+}
+
+// Runs each kernel against a map type T with 1, 2, 4, ... up to
+// FLAGS_benchmark_threads threads, and reports the aggregate throughput and
+// the scaling efficiency: the throughput divided by the throughput of a
+// single thread times the number of threads.
+template <typename T>
+void RunThreads(const char *tree_name) {
+  typedef typename T::mapped_type mapped_type;
+  typedef std::chrono::steady_clock clock;
+
+  const int64_t records = std::max(FLAGS_benchmark_threads_records, 1);
+  T container;
+  for (int64_t i = 0; i < records; ++i) {
+    container.insert(std::make_pair(WorkloadKey(i), mapped_type(i)));
+  }
+
+  vector<int> thread_counts;
+  for (int n = 1; n < FLAGS_benchmark_threads; n *= 2) {
+    thread_counts.push_back(n);
+  }
+  thread_counts.push_back(FLAGS_benchmark_threads);
+
+  // The keys of each thread are generated up front so that the timed loop
+  // only accesses the tree. In the reader/writer kernel a negative key marks
+  // a write. Written keys are disjoint from the records and between threads.
+  const int max_threads = thread_counts.back();
+  vector<vector<int64_t> > keys(max_threads), rw_keys(max_threads);
+  vector<vector<int64_t> > write_keys(max_threads);
+  std::uniform_int_distribution<int64_t> record_dist(0, records - 1);
+  std::bernoulli_distribution write_dist(
+      std::min(std::max(FLAGS_benchmark_threads_write_fraction, 0.0), 1.0));
+  for (int t = 0; t < max_threads; ++t) {
+    std::mt19937_64 rng(FLAGS_test_random_seed + t);
+    for (int i = 0; i < FLAGS_benchmark_threads_ops; ++i) {
+      int64_t key = WorkloadKey(record_dist(rng));
+      keys[t].push_back(key);
+      rw_keys[t].push_back(write_dist(rng) ? -1 : key);
+    }
+    for (int i = 0; i < 1024; ++i) {
+      write_keys[t].push_back(WorkloadKey(records + t * 1024 + i));
+    }
+  }
+
+  std::shared_mutex mu;
+  for (int k = 0; k < kNumThreadsKernels; ++k) {
+    ThreadsKernel kernel = ThreadsKernel(k);
+    const vector<vector<int64_t> > &kernel_keys =
+        kernel == kThreadsReadWrite ? rw_keys : keys;
+    double single_thread_ops_per_sec = 0;
+    for (size_t c = 0; c < thread_counts.size(); ++c) {
+      const int n = thread_counts[c];
+      std::atomic<bool> go(false);
+      vector<std::thread> threads;
+      for (int t = 0; t < n; ++t) {
+        threads.push_back(std::thread(
+            ThreadsWorker<T>, kernel, &container, &mu,
+            std::cref(kernel_keys[t]), std::cref(write_keys[t]), &go));
+      }
+      clock::time_point begin = clock::now();
+      go.store(true, std::memory_order_release);
+      for (int t = 0; t < n; ++t) {
+        threads[t].join();
+      }
+      double seconds =
+          std::chrono::duration<double>(clock::now() - begin).count();
+
+      int64_t ops = std::max<int64_t>(int64_t(n) * kernel_keys[0].size(), 1);
+      double ops_per_sec = ops / seconds;
+      if (n == 1) {
+        single_thread_ops_per_sec = ops_per_sec;
+      }
+      fprintf(stdout, "MT_%s_%s/threads:%d\t%ld\t%ld\tops_per_sec=%.0f"
+              "\tefficiency=%.2f\n",
+              kThreadsKernelNames[kernel], tree_name, n,
+              long(seconds * 1e9 / ops), long(ops), ops_per_sec,
+              ops_per_sec / (n * single_thread_ops_per_sec));
+    }
+  }
+}
+
+#define MY_THREADS_TARGET(type) { #type, RunThreads<type> }
+
+const struct {
+  const char *name;
+  void (*func)(const char *name);
+} kThreadsTargets[] = {
+  MY_THREADS_TARGET(stl_map_int64),
+  MY_THREADS_TARGET(btree_256_map_int64),
+  MY_THREADS_TARGET(btree_2048_map_int64),
+};
+
+// Runs the multi-threaded benchmarks selected by --benchmark_threads.
+void RunThreadsBenchmarks() {
+  for (size_t i = 0; i < sizeof(kThreadsTargets) / sizeof(*kThreadsTargets);
+       ++i) {
+    kThreadsTargets[i].func(kThreadsTargets[i].name);
+  }
+}
+
+// The churn benchmarks keep a btree at FLAGS_benchmark_churn_values elements
+// while erasing one element and inserting another FLAGS_benchmark_churn_ops
+// times, and sample the shape of the tree at intervals to show how its fill
+// evolves:
+//
+//   random   Erases a random element and inserts a random key.
+//   window   Erases the oldest element and inserts the largest key yet, as a
+//            sliding window over a time series does.
+//   hotspot  As random, but 90% of the erasures and insertions fall in a hot
+//            range holding 10% of the elements.
+enum ChurnPattern {
+  kChurnRandom,
+  kChurnWindow,
+  kChurnHotSpot,
+  kNumChurnPatterns,
+};
+
+const char* const kChurnPatternNames[kNumChurnPatterns] = {
+  "random", "window", "hotspot",
+};
+
+// Scatters i over [0, 2^bits) by multiplying by an odd constant, which maps
+// distinct values of i to distinct keys.
+int64_t ChurnKey(int64_t i, int bits) {
+  return int64_t((uint64_t(i) * 0x9e3779b97f4a7c15ULL) &
+                 ((uint64_t(1) << bits) - 1));
+}
+
+template <typename T>
+void PrintChurnSample(const char *pattern, const char *tree_name, int64_t ops,
+                      int64_t interval_ops, double seconds, const T &tree) {
+  fprintf(stdout, "CHURN_%s_%s/%ld\t%ld\t%ld\tsize=%ld\tnodes=%ld"
+          "\theight=%ld\tfullness=%.3f\toverhead=%.2f\tbytes_used=%ld\n",
+          pattern, tree_name, long(ops),
+          long(interval_ops ? seconds * 1e9 / interval_ops : 0),
+          long(interval_ops), long(tree.size()), long(tree.nodes()),
+          long(tree.height()), tree.fullness(), tree.overhead(),
+          long(tree.bytes_used()));
+  fflush(stdout);
+}
+
+template <typename T>
+void RunChurn(const char *tree_name) {
+  typedef typename T::mapped_type mapped_type;
+  typedef std::chrono::steady_clock clock;
+
+  const int64_t n = std::max(FLAGS_benchmark_churn_values, 1);
+  const int64_t ops = FLAGS_benchmark_churn_ops;
+  const int64_t interval = FLAGS_benchmark_churn_interval > 0 ?
+      FLAGS_benchmark_churn_interval : std::max<int64_t>(ops / 20, 1);
+  // Hot keys are below 2^40 and cold keys at or above it.
+  const int kHotBits = 40;
+  const int64_t kColdBase = int64_t(1) << kHotBits;
+
+  for (int p = 0; p < kNumChurnPatterns; ++p) {
+    const ChurnPattern pattern = ChurnPattern(p);
+    std::mt19937_64 rng(FLAGS_test_random_seed);
+    // The live keys, split into the hot and the cold ones for kChurnHotSpot.
+    // For kChurnWindow, live[next % n] is the oldest key.
+    vector<int64_t> live, hot;
+    int64_t next = 0;
+
+    T tree;
+    for (; next < n; ++next) {
+      int64_t key;
+      if (pattern == kChurnWindow) {
+        key = next;
+        live.push_back(key);
+      } else if (pattern == kChurnHotSpot && next % 10 == 0) {
+        key = ChurnKey(next, kHotBits);
+        hot.push_back(key);
+      } else {
+        key = kColdBase + ChurnKey(next, 61);
+        live.push_back(key);
+      }
+      tree.insert(std::make_pair(key, mapped_type(next)));
+    }
+    PrintChurnSample(kChurnPatternNames[pattern], tree_name, 0, 0, 0, tree);
+
+    std::bernoulli_distribution hot_dist(0.9);
+    clock::time_point begin = clock::now();
+    for (int64_t i = 1; i <= ops; ++i, ++next) {
+      if (pattern == kChurnWindow) {
+        int64_t &oldest = live[next % n];
+        tree.erase(oldest);
+        oldest = next;
+        tree.insert(std::make_pair(oldest, mapped_type(next)));
+      } else {
+        bool is_hot = pattern == kChurnHotSpot && hot_dist(rng);
+        vector<int64_t> &keys = is_hot ? hot : live;
+        int64_t &victim = keys[rng() % keys.size()];
+        tree.erase(victim);
+        victim = is_hot ?
+            ChurnKey(next, kHotBits) : kColdBase + ChurnKey(next, 61);
+        tree.insert(std::make_pair(victim, mapped_type(next)));
+      }
+      if (i % interval == 0 || i == ops) {
+        double seconds =
+            std::chrono::duration<double>(clock::now() - begin).count();
+        PrintChurnSample(kChurnPatternNames[pattern], tree_name, i,
+                         (i - 1) % interval + 1, seconds, tree);
+        begin = clock::now();
+      }
+    }
+  }
+}
+
+#define MY_CHURN_TARGET(type) { #type, RunChurn<type> }
+
+const struct {
+  const char *name;
+  void (*func)(const char *name);
+} kChurnTargets[] = {
+  MY_CHURN_TARGET(btree_256_map_int64),
+  MY_CHURN_TARGET(btree_512_map_int64),
+  MY_CHURN_TARGET(btree_1024_map_int64),
+  MY_CHURN_TARGET(btree_2048_map_int64),
+};
+
+// Runs the churn benchmarks selected by --benchmark_churn_ops.
+void RunChurnBenchmarks() {
+  for (size_t i = 0; i < sizeof(kChurnTargets) / sizeof(*kChurnTargets);
+       ++i) {
+    kChurnTargets[i].func(kChurnTargets[i].name);
+  }
+}
+
+// Returns the size of the last level cache in bytes, or a guess if it is
+// unknown.
+int64_t LastLevelCacheBytes() {
+  int64_t bytes = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (bytes <= 0) {
+    bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  }
+#endif
+  return bytes > 0 ? bytes : 32 << 20;
+}
+
+// Evicts the benchmarked tree from the CPU caches by touching every cache
+// line of a buffer four times the size of the last level cache.
+void FlushCaches() {
+  static vector<char> buffer;
+  if (buffer.empty()) {
+    buffer.resize(4 * LastLevelCacheBytes());
+  }
+  intptr_t r = 0;
+  for (size_t i = 0; i < buffer.size(); i += 64) {
+    r += ++buffer[i];
+  }
+  sink(r);
+}
+
+// The out-of-cache benchmarks build a map type T of
+// FLAGS_benchmark_dram_values elements, typically several times the size of
+// the last level cache, and probe it at FLAGS_benchmark_dram_probes random
+// keys. The find phase probes keys in the tree and the lower_bound phase
+// probes keys from the whole key space. Each phase reports the time and the
+// performance counters, in particular the cache and TLB misses, per probe.
+template <typename T>
+void RunDram(const char *tree_name) {
+  typedef typename T::mapped_type mapped_type;
+  typedef std::chrono::steady_clock clock;
+
+  const int64_t n = FLAGS_benchmark_dram_values;
+  const int64_t probes = std::max<int64_t>(FLAGS_benchmark_dram_probes, 1);
+
+  // Keys are scattered over the key space, so insertion order and probe
+  // order are both random with respect to the layout of the tree.
+  T container;
+  clock::time_point begin = clock::now();
+  for (int64_t i = 0; i < n; ++i) {
+    container.insert(std::make_pair(WorkloadKey(i), mapped_type(i)));
+  }
+  double build_seconds =
+      std::chrono::duration<double>(clock::now() - begin).count();
+  fprintf(stdout, "DRAM_build_%s/%ld\t%ld\t%ld\tllc_bytes=%ld\n",
+          tree_name, long(n), long(build_seconds * 1e9 / n), long(n),
+          long(LastLevelCacheBytes()));
+
+  std::mt19937_64 rng(FLAGS_test_random_seed);
+  std::uniform_int_distribution<int64_t> index_dist(0, n - 1);
+  vector<int64_t> keys(probes);
+  for (int phase = 0; phase < 2; ++phase) {
+    const bool find = phase == 0;
+    for (int64_t i = 0; i < probes; ++i) {
+      keys[i] = find ? WorkloadKey(index_dist(rng)) : int64_t(rng() >> 1);
+    }
+    if (FLAGS_benchmark_dram_flush_caches) {
+      FlushCaches();
+    }
+
+    intptr_t r = 0;
+    if (perf_counters) {
+      perf_counters->Reset();
+      perf_counters->Start();
+    }
+    begin = clock::now();
+    for (int64_t i = 0; i < probes; ++i) {
+      typename T::const_iterator it = find ?
+          container.find(keys[i]) : container.lower_bound(keys[i]);
+      if (it != container.end()) {
+        r += it->second;
+      }
+    }
+    double seconds =
+        std::chrono::duration<double>(clock::now() - begin).count();
+    if (perf_counters) {
+      perf_counters->Stop();
+    }
+    sink(r);
+
+    fprintf(stdout, "DRAM_%s_%s/%ld\t%ld\t%ld",
+            find ? "find" : "lower_bound", tree_name, long(n),
+            long(seconds * 1e9 / probes), long(probes));
+    PrintPerfCounters(probes);
+    fprintf(stdout, "\n");
+    fflush(stdout);
+  }
+}
+
+#define MY_DRAM_TARGET(type) { #type, RunDram<type> }
+
+const struct {
+  const char *name;
+  void (*func)(const char *name);
+} kDramTargets[] = {
+  MY_DRAM_TARGET(stl_map_int64),
+  MY_DRAM_TARGET(btree_256_map_int64),
+  MY_DRAM_TARGET(btree_512_map_int64),
+  MY_DRAM_TARGET(btree_1024_map_int64),
+  MY_DRAM_TARGET(btree_2048_map_int64),
+};
+
+// Runs the out-of-cache benchmarks selected by --benchmark_dram_values.
+void RunDramBenchmarks() {
+  for (size_t i = 0; i < sizeof(kDramTargets) / sizeof(*kDramTargets); ++i) {
+    kDramTargets[i].func(kDramTargets[i].name);
+  }
+}
+
 } // namespace
 } // namespace btree
 
 int main(int argc, char **argv) {
-  btree::RunBenchmarks();
-  return 0;
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_benchmark_string_keys != "digits" &&
+      FLAGS_benchmark_string_keys != "url" &&
+      FLAGS_benchmark_string_keys != "composite") {
+    fprintf(stderr, "Invalid --benchmark_string_keys %s\n",
+            FLAGS_benchmark_string_keys.c_str());
+    return 1;
+  }
+  if (FLAGS_benchmark_perf_counters) {
+    btree::perf_counters = new btree::PerfCounters;
+    if (!btree::perf_counters->available()) {
+      fprintf(stderr, "perf_event_open() unavailable; "
+              "reporting timings only\n");
+      delete btree::perf_counters;
+      btree::perf_counters = NULL;
+    }
+  }
+  int ret = 0;
+  if (FLAGS_benchmark_churn_ops > 0) {
+    btree::RunChurnBenchmarks();
+  } else if (FLAGS_benchmark_dram_values > 0) {
+    btree::RunDramBenchmarks();
+  } else if (FLAGS_benchmark_threads > 0) {
+    btree::RunThreadsBenchmarks();
+  } else if (!FLAGS_benchmark_workload.empty() ||
+             !FLAGS_benchmark_trace.empty()) {
+    ret = btree::RunWorkloads() ? 0 : 1;
+  } else {
+    btree::RunBenchmarks();
+  }
+  delete btree::perf_counters;
+  return ret;
 }
@@ -0,0 +1,270 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Measures the memory footprint of btrees and of the STL containers they
+// replace. For each container, insert order and element count this reports:
+//
+//   bytes_used   The btree's own estimate (btree containers only).
+//   requested    The bytes requested from the allocator.
+//   allocated    The bytes malloc actually set aside for those requests,
+//                including its size-class rounding.
+//   rss          The growth of the process's resident set size.
+//
+// Each line has the form
+//
+//   MEM_<container>_<order>/<count>\t<rss bytes per value>\t<count>\t...
+//
+// so that it can be processed alongside the output of btree_bench.
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "cppbtree/btree_map.h"
+#include "cppbtree/btree_set.h"
+
+DEFINE_int32(test_random_seed, 123456789, "Seed for the random insert order");
+DEFINE_int64(memory_bench_min_values, 1000,
+             "The smallest number of elements measured");
+DEFINE_int64(memory_bench_max_values, 100000000,
+             "The largest number of elements measured. Counts are the "
+             "powers of 10 between the minimum and this.");
+
+using std::less;
+using std::string;
+using std::vector;
+
+namespace btree {
+namespace {
+
+// The totals of the CountingAllocator since the last ResetAllocatorCounts().
+int64_t requested_bytes;
+int64_t allocated_bytes;
+
+void ResetAllocatorCounts() {
+  requested_bytes = 0;
+  allocated_bytes = 0;
+}
+
+// An STL allocator which records how many bytes were requested and how many
+// malloc set aside for them.
+template <typename T>
+class CountingAllocator {
+ public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef CountingAllocator<U> other;
+  };
+
+  CountingAllocator() {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  pointer allocate(size_type n, const void *hint = 0) {
+    void *p = malloc(n * sizeof(T));
+    if (p == NULL) {
+      throw std::bad_alloc();
+    }
+    requested_bytes += n * sizeof(T);
+    allocated_bytes += malloc_usable_size(p);
+    return static_cast<pointer>(p);
+  }
+  void deallocate(pointer p, size_type n) {
+    requested_bytes -= n * sizeof(T);
+    allocated_bytes -= malloc_usable_size(p);
+    free(p);
+  }
+  size_type max_size() const {
+    return size_type(-1) / sizeof(T);
+  }
+  void construct(pointer p, const T &v) {
+    new (p) T(v);
+  }
+  void destroy(pointer p) {
+    p->~T();
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+  return false;
+}
+
+// Returns the resident set size of the process in bytes.
+int64_t ResidentBytes() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  long size = 0, resident = 0;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return int64_t(resident) * sysconf(_SC_PAGESIZE);
+}
+
+// Returns the memory freed by earlier measurements to the system, so that it
+// does not hide the growth of the next one.
+void TrimHeap() {
+  malloc_trim(0);
+}
+
+// The btree's estimate of its own size. The STL containers have none.
+template <typename T>
+int64_t BytesUsed(const T &container) {
+  return -1;
+}
+template <typename K, typename C, typename A, int N>
+int64_t BytesUsed(const btree_set<K, C, A, N> &container) {
+  return container.bytes_used();
+}
+template <typename K, typename V, typename C, typename A, int N>
+int64_t BytesUsed(const btree_map<K, V, C, A, N> &container) {
+  return container.bytes_used();
+}
+
+template <typename V>
+V MakeValue(int64_t key, V*) {
+  return key;
+}
+template <typename K, typename V>
+std::pair<K, V> MakeValue(int64_t key, std::pair<const K, V>*) {
+  return std::make_pair(K(key), V(key));
+}
+
+enum InsertOrder {
+  kAscending,
+  kDescending,
+  kRandom,
+  kNumInsertOrders,
+};
+
+const char* const kInsertOrderNames[kNumInsertOrders] = {
+  "ascending", "descending", "random",
+};
+
+// Builds a container of type T holding the keys [0, n) inserted in the
+// given order and reports its footprint.
+template <typename T>
+void MeasureFootprint(const char *name, InsertOrder order, int64_t n) {
+  typedef typename T::value_type value_type;
+
+  // The keys are generated before the baseline so that only the container is
+  // measured.
+  vector<int64_t> keys(n);
+  for (int64_t i = 0; i < n; ++i) {
+    keys[i] = order == kDescending ? n - 1 - i : i;
+  }
+  if (order == kRandom) {
+    std::mt19937_64 rng(FLAGS_test_random_seed);
+    std::shuffle(keys.begin(), keys.end(), rng);
+  }
+
+  TrimHeap();
+  ResetAllocatorCounts();
+  int64_t rss_before = ResidentBytes();
+  {
+    T container;
+    for (int64_t i = 0; i < n; ++i) {
+      container.insert(MakeValue(keys[i], static_cast<value_type*>(NULL)));
+    }
+    int64_t rss = ResidentBytes() - rss_before;
+    fprintf(stdout, "MEM_%s_%s/%ld\t%.2f\t%ld\tbytes_used=%ld"
+            "\trequested=%ld\tallocated=%ld\trss=%ld\n",
+            name, kInsertOrderNames[order], long(n), double(rss) / n,
+            long(n), long(BytesUsed(container)), long(requested_bytes),
+            long(allocated_bytes), long(rss));
+    fflush(stdout);
+  }
+}
+
+template <typename T>
+void MeasureFootprints(const char *name) {
+  for (int64_t n = FLAGS_memory_bench_min_values;
+       n <= FLAGS_memory_bench_max_values; n *= 10) {
+    for (int order = 0; order < kNumInsertOrders; ++order) {
+      MeasureFootprint<T>(name, InsertOrder(order), n);
+    }
+  }
+}
+
+#define MY_MEMORY_TYPES(value, name)                                    \
+  typedef std::set<value, less<value>, CountingAllocator<value> >      \
+    stl_set_ ## name;                                                   \
+  typedef std::map<value, value, less<value>,                           \
+                   CountingAllocator<std::pair<const value, value> > >  \
+    stl_map_ ## name;                                                   \
+  typedef btree_set<value, less<value>, CountingAllocator<value>, 256>  \
+    btree_256_set_ ## name;                                             \
+  typedef btree_map<value, value, less<value>,                          \
+                    CountingAllocator<std::pair<const value, value> >,  \
+                    256>                                                \
+    btree_256_map_ ## name
+
+MY_MEMORY_TYPES(int32_t, int32);
+MY_MEMORY_TYPES(int64_t, int64);
+
+#define MY_MEMORY_TARGET(type) { #type, MeasureFootprints<type> }
+
+const struct {
+  const char *name;
+  void (*func)(const char *name);
+} kMemoryTargets[] = {
+  MY_MEMORY_TARGET(stl_set_int32),
+  MY_MEMORY_TARGET(btree_256_set_int32),
+  MY_MEMORY_TARGET(stl_set_int64),
+  MY_MEMORY_TARGET(btree_256_set_int64),
+  MY_MEMORY_TARGET(stl_map_int32),
+  MY_MEMORY_TARGET(btree_256_map_int32),
+  MY_MEMORY_TARGET(stl_map_int64),
+  MY_MEMORY_TARGET(btree_256_map_int64),
+};
+
+} // namespace
+} // namespace btree
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  for (size_t i = 0;
+       i < sizeof(btree::kMemoryTargets) / sizeof(*btree::kMemoryTargets);
+       ++i) {
+    btree::kMemoryTargets[i].func(btree::kMemoryTargets[i].name);
+  }
+  return 0;
+}
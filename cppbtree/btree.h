@@ -103,6 +103,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <algorithm>
 #include <functional>
@@ -267,6 +268,270 @@ static bool btree_compare_keys(
   return key_comparer::bool_compare(comp, x, y);
 }
 
+// A summary is an associative "combine" over the values of a subtree (a sum,
+// min, max, count, etc). When a params structure specifies a summary_type
+// other than btree_no_summary, internal nodes cache the summary of each child
+// subtree and btree::aggregate() can compute the summary of any key range in
+// O(log n) time. A summary type looks like:
+//
+//  struct MySummary {
+//    typedef int64_t result_type;
+//    // The identity element of combine().
+//    static result_type identity() { return 0; }
+//    // The summary of a single value.
+//    static result_type value(const std::pair<const int64_t, int64_t> &v) {
+//      return v.second;
+//    }
+//    // Combines the summaries of two adjacent ranges. Must be associative
+//    // but need not be commutative: a always precedes b in key order.
+//    static result_type combine(const result_type &a, const result_type &b) {
+//      return a + b;
+//    }
+//  };
+//
+// The result_type must be default constructible, copyable and trivially
+// destructible.
+struct btree_no_summary {
+  typedef std::false_type result_type;
+  static result_type identity() { return result_type(); }
+  template <typename V>
+  static result_type value(const V&) { return result_type(); }
+  static result_type combine(const result_type&, const result_type&) {
+    return result_type();
+  }
+};
+
+// A summary which counts the values in a range.
+struct btree_count_summary {
+  typedef ssize_t result_type;
+  static result_type identity() { return 0; }
+  template <typename V>
+  static result_type value(const V&) { return 1; }
+  static result_type combine(const result_type &a, const result_type &b) {
+    return a + b;
+  }
+};
+
+// A summary which sums the values of a btree_set or the mapped values of a
+// btree_map.
+template <typename T>
+struct btree_sum_summary {
+  typedef T result_type;
+  static result_type identity() { return T(); }
+  static result_type value(const T &v) { return v; }
+  template <typename K>
+  static result_type value(const std::pair<K, T> &v) { return v.second; }
+  static result_type combine(const result_type &a, const result_type &b) {
+    return a + b;
+  }
+};
+
+// The storage for the cached child summaries of an internal node. The
+// specialization for btree_no_summary takes no space.
+template <typename Summary, int N>
+struct btree_summary_fields {
+  typedef typename Summary::result_type result_type;
+
+  const result_type& summary(int i) const { return summaries[i]; }
+  void set_summary(int i, const result_type &s) { summaries[i] = s; }
+  void move_summary(int i, btree_summary_fields *x, int j) {
+    summaries[i] = x->summaries[j];
+  }
+  void swap_summary(int i, btree_summary_fields *x) {
+    btree_swap_helper(summaries[i], x->summaries[i]);
+  }
+
+  result_type summaries[N];
+};
+
+template <int N>
+struct btree_summary_fields<btree_no_summary, N> {
+  typedef btree_no_summary::result_type result_type;
+
+  result_type summary(int i) const { return result_type(); }
+  void set_summary(int i, const result_type &s) {}
+  void move_summary(int i, btree_summary_fields *x, int j) {}
+  void swap_summary(int i, btree_summary_fields *x) {}
+};
+
+// A stats policy counts the structural work done by a btree. When a params
+// structure specifies a stats_type other than btree_no_stats, the btree keeps
+// one instance of it and calls its hooks as it works; the instance is
+// available through btree::stats(). With btree_no_stats the hooks are empty
+// and the btree carries no extra state, so the counting compiles away.
+struct btree_no_stats {
+  void on_split() {}
+  void on_merge() {}
+  void on_rebalance_left_to_right() {}
+  void on_rebalance_right_to_left() {}
+  void on_shrink() {}
+  void on_node_allocation() {}
+  void on_node_free() {}
+  void on_comparison() {}
+  // Called once per root-to-leaf search with the number of nodes searched.
+  void on_descent(int levels) {}
+};
+
+// A stats policy which keeps a running count of each event.
+struct btree_stats {
+  btree_stats()
+      : splits(0),
+        merges(0),
+        rebalances_left_to_right(0),
+        rebalances_right_to_left(0),
+        shrinks(0),
+        node_allocations(0),
+        node_frees(0),
+        comparisons(0),
+        descents(0),
+        descent_levels(0) {
+  }
+
+  void on_split() { ++splits; }
+  void on_merge() { ++merges; }
+  void on_rebalance_left_to_right() { ++rebalances_left_to_right; }
+  void on_rebalance_right_to_left() { ++rebalances_right_to_left; }
+  void on_shrink() { ++shrinks; }
+  void on_node_allocation() { ++node_allocations; }
+  void on_node_free() { ++node_frees; }
+  void on_comparison() { ++comparisons; }
+  void on_descent(int levels) {
+    ++descents;
+    descent_levels += levels;
+  }
+
+  // The average number of nodes searched per descent.
+  double average_descent_depth() const {
+    return descents == 0 ? 0.0 : double(descent_levels) / descents;
+  }
+
+  int64_t splits;
+  int64_t merges;
+  int64_t rebalances_left_to_right;
+  int64_t rebalances_right_to_left;
+  int64_t shrinks;
+  int64_t node_allocations;
+  int64_t node_frees;
+  int64_t comparisons;
+  int64_t descents;
+  int64_t descent_levels;
+};
+
+// The storage for the stats of a btree. The stats are updated by const
+// lookups and are therefore mutable. The specialization for btree_no_stats
+// takes no space.
+template <typename Stats>
+class btree_stats_storage {
+ public:
+  btree_stats_storage() {}
+  // Deliberately does not copy the stats, which describe the work done on x.
+  btree_stats_storage(const btree_stats_storage &x) {}
+
+  const Stats& stats() const { return stats_; }
+  Stats& mutable_stats() const { return stats_; }
+  void swap_stats(btree_stats_storage &x) {
+    btree_swap_helper(stats_, x.stats_);
+  }
+
+ private:
+  mutable Stats stats_;
+};
+
+template <>
+class btree_stats_storage<btree_no_stats> {
+ public:
+  const btree_no_stats& stats() const {
+    static const btree_no_stats kNoStats = btree_no_stats();
+    return kNoStats;
+  }
+  btree_no_stats mutable_stats() const { return btree_no_stats(); }
+  void swap_stats(btree_stats_storage &x) {}
+};
+
+// A comparator which reports each comparison to a stats policy before
+// forwarding it to Compare. It derives from Compare so that it is treated as
+// a compare-to functor exactly when Compare is.
+template <typename Key, typename Compare, typename Stats>
+struct btree_counting_compare : public Compare {
+  typedef typename if_<
+    btree_is_key_compare_to<Compare>::value, int, bool>::type result_type;
+
+  btree_counting_compare(const Compare &c, Stats *s)
+      : Compare(c),
+        stats(s) {
+  }
+  result_type operator()(const Key &a, const Key &b) const {
+    stats->on_comparison();
+    return static_cast<const Compare&>(*this)(a, b);
+  }
+
+  Stats *stats;
+};
+
+// Selects the comparator the btree searches with: the counting comparator
+// when stats are kept and the plain key_compare otherwise.
+template <typename Key, typename Compare, typename Stats>
+struct btree_stats_compare {
+  typedef btree_counting_compare<Key, Compare, Stats> type;
+  static type make(const Compare &c, Stats &s) { return type(c, &s); }
+};
+
+template <typename Key, typename Compare>
+struct btree_stats_compare<Key, Compare, btree_no_stats> {
+  typedef const Compare& type;
+  static type make(const Compare &c, const btree_no_stats&) { return c; }
+};
+
+// A pointer stored as a signed byte offset of type Offset from its own
+// address. A zero offset represents NULL. Relative pointers are only usable
+// when the pointer and its target are close enough for the offset to hold
+// their distance, such as when both live in the same btree_node_arena, and
+// they remain valid when the memory holding both is moved as a whole or mapped
+// at a different address. A 32-bit offset reaches 2GB. A relative pointer
+// cannot be copied to a new address without recomputing the offset, so
+// copying is done through the raw pointer.
+template <typename T, typename Offset = int32_t>
+class btree_relative_pointer {
+ public:
+  T* get() const {
+    return offset_ == 0 ? NULL : reinterpret_cast<T*>(
+        const_cast<char*>(reinterpret_cast<const char*>(this)) + offset_);
+  }
+  operator T*() const { return get(); }
+  T* operator->() const { return get(); }
+
+  btree_relative_pointer& operator=(T *p) {
+    if (p == NULL) {
+      offset_ = 0;
+    } else {
+      ptrdiff_t offset =
+          reinterpret_cast<char*>(p) - reinterpret_cast<char*>(this);
+      assert(offset == Offset(offset) && offset != 0);
+      offset_ = Offset(offset);
+    }
+    return *this;
+  }
+  btree_relative_pointer& operator=(const btree_relative_pointer &x) {
+    return *this = x.get();
+  }
+
+  // Swaps the targets of a and b. The offsets are adjusted with unsigned
+  // arithmetic rather than through get(), so that swapping the uninitialized
+  // child pointers of a node, as btree_node::swap() does, is harmless.
+  friend void swap(btree_relative_pointer &a, btree_relative_pointer &b) {
+    typedef typename std::make_unsigned<Offset>::type unsigned_offset;
+    const unsigned_offset distance = unsigned_offset(
+        reinterpret_cast<uintptr_t>(&b) - reinterpret_cast<uintptr_t>(&a));
+    const Offset offset = a.offset_;
+    a.offset_ =
+        b.offset_ == 0 ? 0 : Offset(unsigned_offset(b.offset_) + distance);
+    b.offset_ = offset == 0 ? 0 : Offset(unsigned_offset(offset) - distance);
+  }
+
+ private:
+  Offset offset_;
+};
+
 template <typename Key, typename Compare,
           typename Alloc, int TargetNodeSize, int ValueSize>
 struct btree_common_params {
@@ -285,6 +550,41 @@ struct btree_common_params {
   typedef ssize_t size_type;
   typedef ptrdiff_t difference_type;
 
+  // The summary cached for each child subtree of an internal node. Derived
+  // params structures may override this; see btree_no_summary.
+  typedef btree_no_summary summary_type;
+
+  // If true, the btree remembers the leaf found by the last lookup and starts
+  // the next lookup there when the key falls within that leaf's separator
+  // keys. Speeds up find/insert streams with strong key locality at the cost
+  // of a pointer per tree and a couple of comparisons per lookup.
+  typedef std::false_type use_hot_leaf_cache;
+
+  // If true, nodes are searched by interpolation rather than by linear or
+  // binary search. See btree_interpolation_search_params.
+  typedef std::false_type use_interpolation_search;
+
+  // The policy which counts splits, merges, comparisons and the like. Derived
+  // params structures may override this; see btree_no_stats.
+  typedef btree_no_stats stats_type;
+
+  // The number of values held in a buffer inside the btree object before a
+  // root leaf is allocated. See btree_inline_params.
+  typedef std::integral_constant<int, 0> inline_values;
+
+  // The type used by nodes to refer to other nodes (their parent, children and
+  // the rightmost leaf). See btree_compressed_node_params.
+  template <typename Node>
+  struct node_pointer {
+    typedef Node* type;
+  };
+  // The type used by the btree object to refer to its root node. See
+  // btree_relocatable_params.
+  template <typename Node>
+  struct root_pointer {
+    typedef Node* type;
+  };
+
   enum {
     kTargetNodeSize = TargetNodeSize,
 
@@ -352,6 +652,116 @@ struct btree_set_params
   }
 };
 
+// A parameters structure which makes the nodes of a btree with parameters
+// Base refer to each other using 32-bit btree_relative_pointers instead of
+// native pointers. This shrinks the node header and, more significantly, the
+// child pointer array of internal nodes, and makes the nodes relocatable. The
+// nodes must be allocated from a region smaller than 2GB, normally by
+// instantiating Base with a btree_arena_allocator (see btree_node_arena.h):
+//
+//   typedef btree_compressed_node_params<btree_set_params<
+//     int32_t, std::less<int32_t>, btree_arena_allocator<int32_t>, 256> >
+//     params_type;
+//   btree_node_arena arena(64 << 20);
+//   btree_arena_allocator<int32_t> alloc(&arena);
+//   btree_unique_container<btree<params_type> > s(
+//       params_type::key_compare(std::less<int32_t>()), alloc);
+template <typename Base>
+struct btree_compressed_node_params : public Base {
+  template <typename Node>
+  struct node_pointer {
+    typedef btree_relative_pointer<Node> type;
+  };
+
+  enum {
+    // The node header is at least 4 bytes of counts and a 4 byte parent.
+    kNodeValueSpace = Base::kTargetNodeSize - 2 * sizeof(int32_t),
+  };
+
+  typedef typename if_<
+    (kNodeValueSpace / Base::kValueSize) >= 256,
+    uint16_t,
+    uint8_t>::type node_count_type;
+};
+
+// A parameters structure which makes a btree with parameters Base position
+// independent, so that it can be built in a region of shared memory and read
+// by other processes which map the region at any address. The nodes and the
+// btree object itself refer to nodes using 64-bit btree_relative_pointers,
+// and both must be allocated in the same region, normally a btree_node_arena
+// of any size in memory supplied by the caller (see btree_node_arena.h). The
+// values must hold no pointers of their own. Lookups must not write to the
+// btree, so the hot leaf cache and stats are switched off:
+//
+//   typedef btree_relocatable_params<btree_map_params<
+//     int64_t, int64_t, std::less<int64_t>,
+//     btree_arena_allocator<int64_t>, 256> > params_type;
+//   typedef btree_map_container<btree<params_type> > shared_map;
+//
+//   // The writer, which alone may modify the map.
+//   btree_node_arena arena(region, size);
+//   shared_map *m = new (arena.allocate(sizeof(shared_map))) shared_map(
+//       shared_map::key_compare(), btree_arena_allocator<int64_t>(&arena));
+//   arena.set_root_object(m);
+//
+//   // A reader, in a process which maps the same region.
+//   btree_node_arena arena(region, size, btree_node_arena::kAttach);
+//   const shared_map *m =
+//       static_cast<const shared_map*>(arena.root_object());
+//
+// The allocator of the btree refers to the writer's btree_node_arena, so only
+// that arena may be used to modify the btree. Readers must be kept from
+// reading while the writer modifies the btree, such as with a process-shared
+// lock.
+template <typename Base>
+struct btree_relocatable_params : public Base {
+  typedef std::false_type use_hot_leaf_cache;
+  typedef btree_no_stats stats_type;
+
+  template <typename Node>
+  struct node_pointer {
+    typedef btree_relative_pointer<Node, int64_t> type;
+  };
+  template <typename Node>
+  struct root_pointer {
+    typedef btree_relative_pointer<Node, int64_t> type;
+  };
+};
+
+// A parameters structure which gives a btree with parameters Base an inline
+// buffer holding a root leaf of up to N values. A btree which never holds more
+// than N values makes no allocations. Once it overflows, its values move to a
+// root leaf on the heap, and the buffer is used again whenever the btree
+// shrinks to empty. The buffer enlarges the btree object by a node header and
+// N values. N must be less than the number of values on a full node:
+//
+//   typedef btree_inline_params<btree_set_params<
+//     int32_t, std::less<int32_t>, std::allocator<int32_t>, 256>, 8>
+//     params_type;
+//   btree_unique_container<btree<params_type> > s;
+template <typename Base, int N>
+struct btree_inline_params : public Base {
+  typedef std::integral_constant<int, N> inline_values;
+};
+
+// A parameters structure which makes a btree with parameters Base search its
+// nodes by interpolation: the search guesses the position of a key from where
+// it falls between the first and last keys of the node and finishes with a
+// linear scan from the guess. For keys spread evenly within each node, such as
+// timestamps, the scan is a step or two whatever the node size, which pays
+// off for large nodes. Other key distributions are searched correctly but may
+// scan as far as a linear search. The key must be an arithmetic type ordered
+// by its value, ascending or descending:
+//
+//   typedef btree_interpolation_search_params<btree_map_params<
+//     int64_t, Event, std::less<int64_t>, std::allocator<int64_t>, 2048> >
+//     params_type;
+//   btree_map_container<btree<params_type> > events;
+template <typename Base>
+struct btree_interpolation_search_params : public Base {
+  typedef std::true_type use_interpolation_search;
+};
+
 // An adapter class that converts a lower-bound compare into an upper-bound
 // compare.
 template <typename Key, typename Compare>
@@ -370,14 +780,18 @@ struct btree_upper_bound_compare_to_adapter : public CompareTo {
   }
 };
 
-// Dispatch helper class for using linear search with plain compare.
+// Dispatch helper class for using linear search with plain compare. The
+// comparator passed in may be Compare or a type derived from it, such as
+// btree_counting_compare.
 template <typename K, typename N, typename Compare>
 struct btree_linear_search_plain_compare {
-  static int lower_bound(const K &k, const N &n, Compare comp)  {
+  template <typename C>
+  static int lower_bound(const K &k, const N &n, const C &comp)  {
     return n.linear_search_plain_compare(k, 0, n.count(), comp);
   }
-  static int upper_bound(const K &k, const N &n, Compare comp)  {
-    typedef btree_upper_bound_adapter<K, Compare> upper_compare;
+  template <typename C>
+  static int upper_bound(const K &k, const N &n, const C &comp)  {
+    typedef btree_upper_bound_adapter<K, C> upper_compare;
     return n.linear_search_plain_compare(k, 0, n.count(), upper_compare(comp));
   }
 };
@@ -385,12 +799,14 @@ struct btree_linear_search_plain_compare {
 // Dispatch helper class for using linear search with compare-to
 template <typename K, typename N, typename CompareTo>
 struct btree_linear_search_compare_to {
-  static int lower_bound(const K &k, const N &n, CompareTo comp)  {
+  template <typename C>
+  static int lower_bound(const K &k, const N &n, const C &comp)  {
     return n.linear_search_compare_to(k, 0, n.count(), comp);
   }
-  static int upper_bound(const K &k, const N &n, CompareTo comp)  {
+  template <typename C>
+  static int upper_bound(const K &k, const N &n, const C &comp)  {
     typedef btree_upper_bound_adapter<K,
-        btree_key_comparer<K, CompareTo, true> > upper_compare;
+        btree_key_comparer<K, C, true> > upper_compare;
     return n.linear_search_plain_compare(k, 0, n.count(), upper_compare(comp));
   }
 };
@@ -398,11 +814,13 @@ struct btree_linear_search_compare_to {
 // Dispatch helper class for using binary search with plain compare.
 template <typename K, typename N, typename Compare>
 struct btree_binary_search_plain_compare {
-  static int lower_bound(const K &k, const N &n, Compare comp)  {
+  template <typename C>
+  static int lower_bound(const K &k, const N &n, const C &comp)  {
     return n.binary_search_plain_compare(k, 0, n.count(), comp);
   }
-  static int upper_bound(const K &k, const N &n, Compare comp)  {
-    typedef btree_upper_bound_adapter<K, Compare> upper_compare;
+  template <typename C>
+  static int upper_bound(const K &k, const N &n, const C &comp)  {
+    typedef btree_upper_bound_adapter<K, C> upper_compare;
     return n.binary_search_plain_compare(k, 0, n.count(), upper_compare(comp));
   }
 };
@@ -410,16 +828,35 @@ struct btree_binary_search_plain_compare {
 // Dispatch helper class for using binary search with compare-to.
 template <typename K, typename N, typename CompareTo>
 struct btree_binary_search_compare_to {
-  static int lower_bound(const K &k, const N &n, CompareTo comp)  {
-    return n.binary_search_compare_to(k, 0, n.count(), CompareTo());
+  template <typename C>
+  static int lower_bound(const K &k, const N &n, const C &comp)  {
+    return n.binary_search_compare_to(k, 0, n.count(), comp);
   }
-  static int upper_bound(const K &k, const N &n, CompareTo comp)  {
+  template <typename C>
+  static int upper_bound(const K &k, const N &n, const C &comp)  {
     typedef btree_upper_bound_adapter<K,
-        btree_key_comparer<K, CompareTo, true> > upper_compare;
+        btree_key_comparer<K, C, true> > upper_compare;
     return n.linear_search_plain_compare(k, 0, n.count(), upper_compare(comp));
   }
 };
 
+// Dispatch helper class for using interpolation search with either plain
+// compare or compare-to.
+template <typename K, typename N, typename Compare>
+struct btree_interpolation_search {
+  template <typename C>
+  static int lower_bound(const K &k, const N &n, const C &comp)  {
+    return n.interpolation_search(k, 0, n.count(), comp);
+  }
+  template <typename C>
+  static int upper_bound(const K &k, const N &n, const C &comp)  {
+    typedef btree_upper_bound_adapter<K,
+        btree_key_comparer<K, C, btree_is_key_compare_to<Compare>::value> >
+      upper_compare;
+    return n.interpolation_search(k, 0, n.count(), upper_compare(comp));
+  }
+};
+
 // A node in the btree holding. The same node type is used for both internal
 // and leaf nodes in the btree, though the nodes are allocated in such a way
 // that the children array is only valid in internal nodes.
@@ -439,6 +876,11 @@ class btree_node {
   typedef typename Params::key_compare key_compare;
   typedef typename Params::size_type size_type;
   typedef typename Params::difference_type difference_type;
+  typedef typename Params::summary_type summary_type;
+  typedef typename summary_type::result_type summary_result_type;
+  // The type stored in a node to refer to another node.
+  typedef typename Params::template node_pointer<
+    self_type>::type node_pointer;
   // Typedefs for the various types of node searches.
   typedef btree_linear_search_plain_compare<
     key_type, self_type, key_compare> linear_search_plain_compare_type;
@@ -448,6 +890,8 @@ class btree_node {
     key_type, self_type, key_compare> binary_search_plain_compare_type;
   typedef btree_binary_search_compare_to<
     key_type, self_type, key_compare> binary_search_compare_to_type;
+  typedef btree_interpolation_search<
+    key_type, self_type, key_compare> interpolation_search_type;
   // If we have a valid key-compare-to type, use linear_search_compare_to,
   // otherwise use linear_search_plain_compare.
   typedef typename if_<
@@ -466,7 +910,11 @@ class btree_node {
   typedef typename if_<
     std::is_integral<key_type>::value ||
     std::is_floating_point<key_type>::value,
-    linear_search_type, binary_search_type>::type search_type;
+    linear_search_type, binary_search_type>::type default_search_type;
+  // Interpolation search is only used when the params ask for it.
+  typedef typename if_<
+    Params::use_interpolation_search::value,
+    interpolation_search_type, default_search_type>::type search_type;
 
   struct base_fields {
     typedef typename Params::node_count_type field_type;
@@ -480,7 +928,7 @@ class btree_node {
     // The count of the number of values in the node.
     field_type count;
     // A pointer to the node's parent.
-    btree_node *parent;
+    node_pointer parent;
   };
 
   enum {
@@ -504,16 +952,25 @@ class btree_node {
     mutable_value_type values[kNodeValues];
   };
 
-  struct internal_fields : public leaf_fields {
+  // The cached summaries of the child subtrees: summary(i) is the summary of
+  // the values in children[i]. Empty unless a summary_type is configured.
+  typedef btree_summary_fields<
+    summary_type, kNodeValues + 1> summary_fields;
+
+  struct internal_fields : public leaf_fields, public summary_fields {
     // The array of child pointers. The keys in children_[i] are all less than
     // key(i). The keys in children_[i + 1] are all greater than key(i). There
     // are always count + 1 children.
-    btree_node *children[kNodeValues + 1];
+    node_pointer children[kNodeValues + 1];
   };
 
   struct root_fields : public internal_fields {
-    btree_node *rightmost;
+    node_pointer rightmost;
     size_type size;
+    // The number of leaf and internal nodes in the tree, including the root,
+    // so that the node statistics do not require a walk of the tree.
+    size_type leaf_nodes;
+    size_type internal_nodes;
   };
 
  public:
@@ -536,6 +993,12 @@ class btree_node {
   // root of the tree is the leftmost node in the tree which is guaranteed to
   // be a leaf.
   bool is_root() const { return parent()->leaf(); }
+  // Setter for the parent of the root node, which is only known once the
+  // leftmost leaf exists. Other nodes get their parent from set_child().
+  void set_root_parent(btree_node *leftmost) {
+    assert(leftmost->leaf());
+    fields_.parent = leftmost;
+  }
   void make_root() {
     assert(parent()->is_root());
     fields_.parent = fields_.parent->parent();
@@ -543,12 +1006,18 @@ class btree_node {
 
   // Getter for the rightmost root node field. Only valid on the root node.
   btree_node* rightmost() const { return fields_.rightmost; }
-  btree_node** mutable_rightmost() { return &fields_.rightmost; }
+  node_pointer* mutable_rightmost() { return &fields_.rightmost; }
 
   // Getter for the size root node field. Only valid on the root node.
   size_type size() const { return fields_.size; }
   size_type* mutable_size() { return &fields_.size; }
 
+  // Getters for the node count root node fields. Only valid on the root node.
+  size_type leaf_nodes() const { return fields_.leaf_nodes; }
+  size_type* mutable_leaf_nodes() { return &fields_.leaf_nodes; }
+  size_type internal_nodes() const { return fields_.internal_nodes; }
+  size_type* mutable_internal_nodes() { return &fields_.internal_nodes; }
+
   // Getters for the key/value at position i in the node.
   const key_type& key(int i) const {
     return params_type::key(fields_.values[i]);
@@ -570,13 +1039,27 @@ class btree_node {
 
   // Getters/setter for the child at position i in the node.
   btree_node* child(int i) const { return fields_.children[i]; }
-  btree_node** mutable_child(int i) { return &fields_.children[i]; }
+  node_pointer* mutable_child(int i) { return &fields_.children[i]; }
   void set_child(int i, btree_node *c) {
     *mutable_child(i) = c;
     c->fields_.parent = this;
     c->fields_.position = i;
   }
 
+  // Getter/setter for the cached summary of the child at position i. Only
+  // valid on internal nodes.
+  summary_result_type child_summary(int i) const {
+    return fields_.summary(i);
+  }
+  void set_child_summary(int i, const summary_result_type &s) {
+    fields_.set_summary(i, s);
+  }
+  // Moves the cached summary of the child at position j in node x to
+  // position i in this node. Must accompany every move of a child pointer.
+  void move_child_summary(int i, btree_node *x, int j) {
+    fields_.move_summary(i, &x->fields_, j);
+  }
+
   // Returns the position of the first value whose key is not less than k.
   template <typename Compare>
   int lower_bound(const key_type &k, const Compare &comp) const {
@@ -659,6 +1142,41 @@ class btree_node {
     return s;
   }
 
+  // Returns the position of the first value whose key is not less than k using
+  // interpolation search. The guess only decides where the linear scan
+  // starts, so the result is correct whatever the distribution of the keys.
+  template <typename Compare>
+  int interpolation_search(
+      const key_type &k, int s, int e, const Compare &comp) const {
+    if (s == e || !btree_compare_keys(comp, key(s), k)) {
+      return s;
+    }
+    if (btree_compare_keys(comp, key(e - 1), k)) {
+      return e;
+    }
+    // key(s) < k <= key(e - 1), so the result is in (s, e - 1]. The fraction
+    // is computed in floating point so that it cannot overflow; a key range
+    // involving infinities yields NaN, which starts the scan at s + 1.
+    const double first = static_cast<double>(key(s));
+    const double fraction =
+      (static_cast<double>(k) - first) /
+      (static_cast<double>(key(e - 1)) - first);
+    int i = s + 1;
+    if (fraction > 0) {
+      i += static_cast<int>(std::min(fraction, 1.0) * (e - s - 2));
+    }
+    if (btree_compare_keys(comp, key(i), k)) {
+      do {
+        ++i;
+      } while (btree_compare_keys(comp, key(i), k));
+    } else {
+      while (i > s + 1 && !btree_compare_keys(comp, key(i - 1), k)) {
+        --i;
+      }
+    }
+    return i;
+  }
+
   // Inserts the value x at position i, shifting all existing values and
   // children at positions >= i to the right by 1.
   void insert_value(int i, const value_type &x);
@@ -707,6 +1225,9 @@ class btree_node {
     btree_node *n = init_internal(f, parent);
     f->rightmost = parent;
     f->size = parent->count();
+    // The new root and the leaf it replaces.
+    f->leaf_nodes = 1;
+    f->internal_nodes = 1;
     return n;
   }
   void destroy() {
@@ -850,15 +1371,92 @@ struct btree_internal_locate_compare_to {
   }
 };
 
+// The storage for the hot-leaf cache of a btree. The cache is updated by
+// const lookups and is therefore mutable. The specialization for a disabled
+// cache takes no space.
+template <typename Node, bool Enabled>
+class btree_hot_leaf_cache {
+ public:
+  btree_hot_leaf_cache() : hot_leaf_(NULL) {}
+  // Deliberately does not copy the cached leaf, which belongs to x.
+  btree_hot_leaf_cache(const btree_hot_leaf_cache &x) : hot_leaf_(NULL) {}
+
+  Node* hot_leaf() const { return hot_leaf_; }
+  void set_hot_leaf(const Node *n) const { hot_leaf_ = const_cast<Node*>(n); }
+  void swap_hot_leaf(btree_hot_leaf_cache &x) {
+    btree_swap_helper(hot_leaf_, x.hot_leaf_);
+  }
+
+ private:
+  mutable Node *hot_leaf_;
+};
+
+template <typename Node>
+class btree_hot_leaf_cache<Node, false> {
+ public:
+  Node* hot_leaf() const { return NULL; }
+  void set_hot_leaf(const Node *n) const {}
+  void swap_hot_leaf(btree_hot_leaf_cache &x) {}
+};
+
+// The storage for the inline root leaf of a btree, holding up to N values. The
+// specialization for N == 0 takes no space.
+template <typename Node, int N>
+class btree_inline_root {
+  typedef typename Node::base_fields base_fields;
+  typedef typename Node::leaf_fields leaf_fields;
+  typedef typename Node::value_type value_type;
+
+ public:
+  btree_inline_root() {}
+  // Deliberately does not copy the buffer, which holds a node of x.
+  btree_inline_root(const btree_inline_root &x) {}
+
+  leaf_fields* inline_root_fields() {
+    return reinterpret_cast<leaf_fields*>(&buffer_);
+  }
+  bool is_inline_root(const Node *n) const {
+    return reinterpret_cast<const void*>(n) == &buffer_;
+  }
+
+ private:
+  typename std::aligned_storage<
+    sizeof(base_fields) + N * sizeof(value_type),
+    alignof(leaf_fields)>::type buffer_;
+};
+
+template <typename Node>
+class btree_inline_root<Node, 0> {
+  typedef typename Node::leaf_fields leaf_fields;
+
+ public:
+  leaf_fields* inline_root_fields() { return NULL; }
+  bool is_inline_root(const Node *n) const { return false; }
+};
+
 template <typename Params>
-class btree : public Params::key_compare {
+class btree
+    : public Params::key_compare,
+      private btree_hot_leaf_cache<btree_node<Params>,
+                                   Params::use_hot_leaf_cache::value>,
+      private btree_stats_storage<typename Params::stats_type>,
+      private btree_inline_root<btree_node<Params>,
+                                Params::inline_values::value> {
   typedef btree<Params> self_type;
   typedef btree_node<Params> node_type;
+  typedef typename Params::template root_pointer<node_type>::type
+    root_pointer;
   typedef typename node_type::base_fields base_fields;
   typedef typename node_type::leaf_fields leaf_fields;
   typedef typename node_type::internal_fields internal_fields;
   typedef typename node_type::root_fields root_fields;
   typedef typename Params::is_key_compare_to is_key_compare_to;
+  typedef typename Params::summary_type summary_type;
+  typedef btree_hot_leaf_cache<
+    node_type, Params::use_hot_leaf_cache::value> hot_leaf_cache;
+  typedef btree_stats_compare<
+    typename Params::key_type, typename Params::key_compare,
+    typename Params::stats_type> stats_compare;
 
   friend class btree_internal_locate_plain_compare;
   friend class btree_internal_locate_compare_to;
@@ -873,8 +1471,13 @@ class btree : public Params::key_compare {
     kValueSize = node_type::kValueSize,
     kExactMatch = node_type::kExactMatch,
     kMatchMask = node_type::kMatchMask,
+    kHasSummary = !std::is_same<summary_type, btree_no_summary>::value,
+    kInlineValues = Params::inline_values::value,
   };
 
+  // A full inline root would be split in place rather than moved to the heap.
+  COMPILE_ASSERT(kInlineValues < kNodeValues, inline_values_too_large);
+
   // A helper class to get the empty base class optimization for 0-size
   // allocators. Base is internal_allocator_type.
   // (e.g. empty_base_handle<internal_allocator_type, node_type*>). If Base is
@@ -927,6 +1530,8 @@ class btree : public Params::key_compare {
   typedef typename Params::allocator_type allocator_type;
   typedef typename allocator_type::template rebind<char>::other
     internal_allocator_type;
+  typedef typename summary_type::result_type summary_result_type;
+  typedef typename Params::stats_type stats_type;
 
  public:
   // Default constructor.
@@ -976,6 +1581,17 @@ class btree : public Params::key_compare {
         internal_lower_bound(key, const_iterator(root(), 0)));
   }
 
+  // Finds the first element whose key is not less than key, searching outward
+  // from hint rather than from the root. The search climbs from hint only as
+  // far as needed to bracket key and then descends, so it costs O(log d)
+  // where d is the distance between hint and the result.
+  iterator lower_bound(iterator hint, const key_type &key) {
+    return internal_end(internal_last(internal_locate_from(key, hint)));
+  }
+  const_iterator lower_bound(const_iterator hint, const key_type &key) const {
+    return internal_end(internal_last(internal_locate_from(key, hint)));
+  }
+
   // Finds the first element whose key is greater than key.
   iterator upper_bound(const key_type &key) {
     return internal_end(
@@ -1042,8 +1658,15 @@ class btree : public Params::key_compare {
   template <typename InputIterator>
   void insert_multi(InputIterator b, InputIterator e);
 
+  // Makes this btree a copy of x. The copy mirrors the structure of x, node
+  // for node, without comparing keys or rebalancing.
   void assign(const self_type &x);
 
+  // Makes this btree a copy of x built with full leaves and the lowest
+  // possible height. Suits snapshots which are read far more than they are
+  // modified. x may be *this, in which case the btree is repacked.
+  void assign_packed(const self_type &x);
+
   // Erase the specified iterator from the btree. The iterator must be valid
   // (i.e. not equal to end()).  Return an iterator pointing to the node after
   // the one that was erased (or end() if none exists).
@@ -1079,6 +1702,15 @@ class btree : public Params::key_compare {
         internal_find_multi(key, const_iterator(root(), 0)));
   }
 
+  // Finds the first element matching key, searching outward from hint. See
+  // lower_bound(hint, key). Works for both unique and multi btrees.
+  iterator find(iterator hint, const key_type &key) {
+    return internal_end(internal_find_from(key, hint));
+  }
+  const_iterator find(const_iterator hint, const key_type &key) const {
+    return internal_end(internal_find_from(key, hint));
+  }
+
   // Returns a count of the number of times the key appears in the btree.
   size_type count_unique(const key_type &key) const {
     const_iterator begin = internal_find_unique(
@@ -1091,7 +1723,65 @@ class btree : public Params::key_compare {
   }
   // Returns a count of the number of times the key appears in the btree.
   size_type count_multi(const key_type &key) const {
-    return distance(lower_bound(key), upper_bound(key));
+    return std::distance(lower_bound(key), upper_bound(key));
+  }
+
+  // Returns the summary of the values whose keys are in the range [lo, hi),
+  // or summary_type::identity() if the range is empty. Runs in O(log n) time
+  // using the summaries cached on the internal nodes.
+  summary_result_type aggregate(const key_type &lo, const key_type &hi) const {
+    if (empty() || !compare_keys(lo, hi)) {
+      return summary_type::identity();
+    }
+    return internal_aggregate(root(), &lo, &hi);
+  }
+  // Returns the summary of all of the values in the btree.
+  summary_result_type aggregate() const {
+    if (empty()) {
+      return summary_type::identity();
+    }
+    return internal_aggregate(root(), NULL, NULL);
+  }
+
+  // Calls f(begin, end) for each contiguous run [begin, end) of the values
+  // whose keys are in the range [lo, hi), in key order. A run is the part of a
+  // leaf within the range or a single separator value on an internal node.
+  // Iteration stops early if f returns false. Returns false if it stopped
+  // early and true otherwise. Lets range scans work on plain arrays rather
+  // than stepping an iterator per value.
+  template <typename F>
+  bool for_each_span(const key_type &lo, const key_type &hi, F f) const {
+    if (!compare_keys(lo, hi)) {
+      return true;
+    }
+    return internal_for_each_span(lower_bound(lo), lower_bound(hi), f);
+  }
+  template <typename F>
+  bool for_each_span(F f) const {
+    return internal_for_each_span(begin(), end(), f);
+  }
+  // As for_each_span(), but visits the runs in reverse key order. The values
+  // within each run are still passed in ascending order as [begin, end).
+  template <typename F>
+  bool for_each_span_reverse(
+      const key_type &lo, const key_type &hi, F f) const {
+    if (!compare_keys(lo, hi)) {
+      return true;
+    }
+    return internal_for_each_span_reverse(lower_bound(lo), lower_bound(hi), f);
+  }
+  template <typename F>
+  bool for_each_span_reverse(F f) const {
+    return internal_for_each_span_reverse(begin(), end(), f);
+  }
+
+  // Recomputes the cached summaries on the path from iter to the root. Must be
+  // called after modifying a value in place (e.g. the mapped value of a
+  // btree_map) if the summary depends on it.
+  void update_summary(iterator iter) {
+    if (iter.node) {
+      update_summaries(iter.node);
+    }
   }
 
   // Clear the btree, deleting all of the values it contains.
@@ -1117,9 +1807,13 @@ class btree : public Params::key_compare {
     return *this;
   }
   bool compare_keys(const key_type &x, const key_type &y) const {
-    return btree_compare_keys(key_comp(), x, y);
+    return btree_compare_keys(search_comp(), x, y);
   }
 
+  // The counts kept by the params' stats_type. With the default
+  // btree_no_stats nothing is counted.
+  using btree_stats_storage<stats_type>::stats;
+
   // Dump the btree to the specified ostream. Requires that operator<< is
   // defined for Key and Value.
   void dump(std::ostream &os) const {
@@ -1157,22 +1851,26 @@ class btree : public Params::key_compare {
     return h;
   }
 
-  // The number of internal, leaf and total nodes used by the btree.
+  // The number of internal, leaf and total nodes used by the btree. These are
+  // maintained as nodes are created and deleted and take constant time.
   size_type leaf_nodes() const {
-    return internal_stats(root()).leaf_nodes;
+    return node_counts().leaf_nodes;
   }
   size_type internal_nodes() const {
-    return internal_stats(root()).internal_nodes;
+    return node_counts().internal_nodes;
   }
   size_type nodes() const {
-    node_stats stats = internal_stats(root());
+    node_stats stats = node_counts();
     return stats.leaf_nodes + stats.internal_nodes;
   }
 
   // The total number of bytes used by the btree.
   size_type bytes_used() const {
-    node_stats stats = internal_stats(root());
+    node_stats stats = node_counts();
     if (stats.leaf_nodes == 1 && stats.internal_nodes == 0) {
+      if (this->is_inline_root(root())) {
+        return sizeof(*this);
+      }
       return sizeof(*this) +
           sizeof(base_fields) + root()->max_count() * sizeof(value_type);
     } else {
@@ -1212,7 +1910,7 @@ class btree : public Params::key_compare {
   // Internal accessor routines.
   node_type* root() { return root_.data; }
   const node_type* root() const { return root_.data; }
-  node_type** mutable_root() { return &root_.data; }
+  root_pointer* mutable_root() { return &root_.data; }
 
   // The rightmost node is stored in the root node.
   node_type* rightmost() {
@@ -1221,7 +1919,9 @@ class btree : public Params::key_compare {
   const node_type* rightmost() const {
     return (!root() || root()->leaf()) ? root() : root()->rightmost();
   }
-  node_type** mutable_rightmost() { return root()->mutable_rightmost(); }
+  typename node_type::node_pointer* mutable_rightmost() {
+    return root()->mutable_rightmost();
+  }
 
   // The leftmost node is stored as the parent of the root node.
   node_type* leftmost() { return root() ? root()->parent() : NULL; }
@@ -1238,41 +1938,71 @@ class btree : public Params::key_compare {
     return *static_cast<const internal_allocator_type*>(&root_);
   }
 
+  // The comparator used for searching, which counts comparisons when the
+  // params keep stats.
+  typename stats_compare::type search_comp() const {
+    return stats_compare::make(key_comp(), this->mutable_stats());
+  }
+
   // Node creation/deletion routines.
   node_type* new_internal_node(node_type *parent) {
     internal_fields *p = reinterpret_cast<internal_fields*>(
         mutable_internal_allocator()->allocate(sizeof(internal_fields)));
+    this->mutable_stats().on_node_allocation();
+    ++*root()->mutable_internal_nodes();
     return node_type::init_internal(p, parent);
   }
   node_type* new_internal_root_node() {
     root_fields *p = reinterpret_cast<root_fields*>(
         mutable_internal_allocator()->allocate(sizeof(root_fields)));
+    this->mutable_stats().on_node_allocation();
     return node_type::init_root(p, root()->parent());
   }
   node_type* new_leaf_node(node_type *parent) {
     leaf_fields *p = reinterpret_cast<leaf_fields*>(
         mutable_internal_allocator()->allocate(sizeof(leaf_fields)));
+    this->mutable_stats().on_node_allocation();
+    ++*root()->mutable_leaf_nodes();
     return node_type::init_leaf(p, parent, kNodeValues);
   }
   node_type* new_leaf_root_node(int max_count) {
+    if (max_count <= kInlineValues && !this->is_inline_root(root())) {
+      leaf_fields *p = this->inline_root_fields();
+      return node_type::init_leaf(
+          p, reinterpret_cast<node_type*>(p), kInlineValues);
+    }
     leaf_fields *p = reinterpret_cast<leaf_fields*>(
         mutable_internal_allocator()->allocate(
             sizeof(base_fields) + max_count * sizeof(value_type)));
+    this->mutable_stats().on_node_allocation();
     return node_type::init_leaf(p, reinterpret_cast<node_type*>(p), max_count);
   }
   void delete_internal_node(node_type *node) {
     node->destroy();
     assert(node != root());
+    this->mutable_stats().on_node_free();
+    --*root()->mutable_internal_nodes();
     mutable_internal_allocator()->deallocate(
         reinterpret_cast<char*>(node), sizeof(internal_fields));
   }
   void delete_internal_root_node() {
     root()->destroy();
+    this->mutable_stats().on_node_free();
     mutable_internal_allocator()->deallocate(
         reinterpret_cast<char*>(root()), sizeof(root_fields));
   }
   void delete_leaf_node(node_type *node) {
+    if (node == this->hot_leaf()) {
+      this->set_hot_leaf(NULL);
+    }
     node->destroy();
+    if (this->is_inline_root(node)) {
+      return;
+    }
+    this->mutable_stats().on_node_free();
+    if (node != root()) {
+      --*root()->mutable_leaf_nodes();
+    }
     mutable_internal_allocator()->deallocate(
         reinterpret_cast<char*>(node),
         sizeof(base_fields) + node->max_count() * sizeof(value_type));
@@ -1294,6 +2024,26 @@ class btree : public Params::key_compare {
   // Tries to shrink the height of the tree by 1.
   void try_shrink();
 
+  // Computes the summary of the values on node and in its subtrees from the
+  // values and cached child summaries on node.
+  summary_result_type node_summary(const node_type *node) const;
+
+  // Updates the summary cached on the parent of node. A no-op for the root.
+  void update_child_summary(node_type *node) {
+    if (kHasSummary && node != root()) {
+      node->parent()->set_child_summary(node->position(), node_summary(node));
+    }
+  }
+
+  // Updates the summaries cached on the path from node to the root.
+  void update_summaries(node_type *node) {
+    if (kHasSummary) {
+      for (; node != root(); node = node->parent()) {
+        update_child_summary(node);
+      }
+    }
+  }
+
   iterator internal_end(iterator iter) {
     return iter.node ? iter : end();
   }
@@ -1331,6 +2081,18 @@ class btree : public Params::key_compare {
   std::pair<IterType, int> internal_locate_compare_to(
       const key_type &key, IterType iter) const;
 
+  // Returns true if a lookup for key from the root would end on leaf, in
+  // which case internal_locate() may start from leaf instead.
+  bool hot_leaf_contains(const node_type *leaf, const key_type &key) const;
+
+  // Returns an iterator pointing to the leaf position at which key would
+  // reside in the tree (the first position not less than key), searching
+  // outward from hint. Climbs from hint until the subtree is bracketed by
+  // separator keys from its parent then descends. Any valid iterator,
+  // including end(), may be passed as hint.
+  template <typename IterType>
+  IterType internal_locate_from(const key_type &key, IterType hint) const;
+
   // Internal routine which implements lower_bound().
   template <typename IterType>
   IterType internal_lower_bound(
@@ -1351,6 +2113,41 @@ class btree : public Params::key_compare {
   IterType internal_find_multi(
       const key_type &key, IterType iter) const;
 
+  // Internal routine which implements find(hint, key).
+  template <typename IterType>
+  IterType internal_find_from(
+      const key_type &key, IterType hint) const;
+
+  // Internal routines which implement for_each_span() and
+  // for_each_span_reverse() over the values in [first, last).
+  template <typename F>
+  bool internal_for_each_span(
+      const_iterator first, const_iterator last, F &f) const;
+  template <typename F>
+  bool internal_for_each_span_reverse(
+      const_iterator first, const_iterator last, F &f) const;
+
+  // Internal routine which implements aggregate(). Returns the summary of the
+  // values in the subtree rooted at node whose keys are not less than *lo and
+  // less than *hi. A NULL bound is unbounded.
+  summary_result_type internal_aggregate(
+      const node_type *node, const key_type *lo, const key_type *hi) const;
+
+  // Allocates the root of a copy of height > 1. The node counts on the root
+  // are maintained as the rest of the copy is allocated, and finish_copy()
+  // fills in the remaining root fields.
+  node_type* new_copy_root_node();
+  void finish_copy(size_type size);
+
+  // Copies the values of src onto the empty node dest and, for an internal
+  // node, copies the children of src as new children of dest.
+  void internal_copy(const node_type *src, node_type *dest);
+
+  // Fills the empty node dest with the next n values from *iter, building a
+  // subtree of the given height whose leaves are as full as possible.
+  void internal_build(node_type *dest, size_type n, int height,
+                      const_iterator *iter);
+
   // Deletes a node and all of its children.
   void internal_clear(node_type *node);
 
@@ -1361,6 +2158,20 @@ class btree : public Params::key_compare {
   int internal_verify(const node_type *node,
                       const key_type *lo, const key_type *hi) const;
 
+  // The node counts kept on the root node. A tree whose root is a leaf has
+  // no root_fields and consists of just that leaf.
+  node_stats node_counts() const {
+    if (!root()) {
+      return node_stats(0, 0);
+    }
+    if (root()->leaf()) {
+      return node_stats(1, 0);
+    }
+    return node_stats(root()->leaf_nodes(), root()->internal_nodes());
+  }
+
+  // Counts the nodes of the subtree rooted at node by walking it. Used to
+  // verify the counts kept on the root node.
   node_stats internal_stats(const node_type *node) const {
     if (!node) {
       return node_stats(0, 0);
@@ -1376,7 +2187,7 @@ class btree : public Params::key_compare {
   }
 
  private:
-  empty_base_handle<internal_allocator_type, node_type*> root_;
+  empty_base_handle<internal_allocator_type, root_pointer> root_;
 
  private:
   // A never instantiated helper function that returns big_ if we have a
@@ -1410,8 +2221,14 @@ class btree : public Params::key_compare {
                  target_node_size_too_large);
 
   // Test the assumption made in setting kNodeValueSpace.
-  COMPILE_ASSERT(sizeof(base_fields) >= 2 * sizeof(void*),
+  COMPILE_ASSERT(sizeof(base_fields) >=
+                 params_type::kTargetNodeSize - params_type::kNodeValueSpace,
                  node_space_assumption_incorrect);
+
+  // Interpolation search does arithmetic on the keys.
+  COMPILE_ASSERT(!params_type::use_interpolation_search::value ||
+                 std::is_arithmetic<key_type>::value,
+                 interpolation_search_requires_arithmetic_keys);
 };
 
 ////
@@ -1430,6 +2247,7 @@ inline void btree_node<P>::insert_value(int i, const value_type &x) {
     for (int j = count(); j > i; --j) {
       *mutable_child(j) = child(j - 1);
       child(j)->set_position(j);
+      move_child_summary(j, this, j - 1);
     }
     *mutable_child(i) = NULL;
   }
@@ -1442,6 +2260,7 @@ inline void btree_node<P>::remove_value(int i) {
     for (int j = i + 1; j < count(); ++j) {
       *mutable_child(j) = child(j + 1);
       child(j)->set_position(j);
+      move_child_summary(j, this, j + 1);
     }
     *mutable_child(count()) = NULL;
   }
@@ -1487,10 +2306,12 @@ void btree_node<P>::rebalance_right_to_left(btree_node *src, int to_move) {
     // Move the child pointers from the right to the left node.
     for (int i = 0; i < to_move; ++i) {
       set_child(1 + count() + i, src->child(i));
+      move_child_summary(1 + count() + i, src, i);
     }
     for (int i = 0; i <= src->count() - to_move; ++i) {
       assert(i + to_move <= src->max_count());
       src->set_child(i, src->child(i + to_move));
+      src->move_child_summary(i, src, i + to_move);
       *src->mutable_child(i + to_move) = NULL;
     }
   }
@@ -1532,10 +2353,12 @@ void btree_node<P>::rebalance_left_to_right(btree_node *dest, int to_move) {
     // Move the child pointers from the left to the right node.
     for (int i = dest->count(); i >= 0; --i) {
       dest->set_child(i + to_move, dest->child(i));
+      dest->move_child_summary(i + to_move, dest, i);
       *dest->mutable_child(i) = NULL;
     }
     for (int i = 1; i <= to_move; ++i) {
       dest->set_child(i - 1, child(count() - to_move + i));
+      dest->move_child_summary(i - 1, this, count() - to_move + i);
       *mutable_child(count() - to_move + i) = NULL;
     }
   }
@@ -1581,6 +2404,7 @@ void btree_node<P>::split(btree_node *dest, int insert_position) {
     for (int i = 0; i <= dest->count(); ++i) {
       assert(child(count() + i + 1) != NULL);
       dest->set_child(i, child(count() + i + 1));
+      dest->move_child_summary(i, this, count() + i + 1);
       *mutable_child(count() + i + 1) = NULL;
     }
   }
@@ -1606,6 +2430,7 @@ void btree_node<P>::merge(btree_node *src) {
     // Move the child pointers from the right to the left node.
     for (int i = 0; i <= src->count(); ++i) {
       set_child(1 + count() + i, src->child(i));
+      move_child_summary(1 + count() + i, src, i);
       *src->mutable_child(i) = NULL;
     }
   }
@@ -1644,6 +2469,7 @@ void btree_node<P>::swap(btree_node *x) {
     // Swap the child pointers.
     for (int i = 0; i <= n; ++i) {
       btree_swap_helper(*mutable_child(i), *x->mutable_child(i));
+      fields_.swap_summary(i, &x->fields_);
     }
     for (int i = 0; i <= count(); ++i) {
       x->child(i)->fields_.parent = x;
@@ -1727,13 +2553,13 @@ void btree_iterator<N, R, P>::decrement_slow() {
 template <typename P>
 btree<P>::btree(const key_compare &comp, const allocator_type &alloc)
     : key_compare(comp),
-      root_(alloc, NULL) {
+      root_(alloc, root_pointer()) {
 }
 
 template <typename P>
 btree<P>::btree(const self_type &x)
     : key_compare(x.key_comp()),
-      root_(x.internal_allocator(), NULL) {
+      root_(x.internal_allocator(), root_pointer()) {
   assign(x);
 }
 
@@ -1782,6 +2608,15 @@ btree<P>::insert_unique(iterator position, const value_type &v) {
       // position.key() == key
       return position;
     }
+    // The hint is not adjacent to key: search outward from it rather than
+    // descending from the root.
+    iterator iter = internal_locate_from(key, position);
+    iterator last = internal_last(iter);
+    if (last.node && !compare_keys(key, last.key())) {
+      // The key already exists in the tree, do nothing.
+      return last;
+    }
+    return internal_insert(iter, v);
   }
   return insert_unique(v).first;
 }
@@ -1844,17 +2679,52 @@ void btree<P>::assign(const self_type &x) {
   *mutable_key_comp() = x.key_comp();
   *mutable_internal_allocator() = x.internal_allocator();
 
-  // Assignment can avoid key comparisons because we know the order of the
-  // values is the same order we'll store them in.
-  for (const_iterator iter = x.begin(); iter != x.end(); ++iter) {
-    if (empty()) {
-      insert_multi(*iter);
-    } else {
-      // If the btree is not empty, we can just insert the new value at the end
-      // of the tree!
-      internal_insert(end(), *iter);
-    }
+  if (x.empty()) {
+    return;
+  }
+  if (x.root()->leaf()) {
+    *mutable_root() = new_leaf_root_node(x.root()->max_count());
+    internal_copy(x.root(), root());
+    return;
+  }
+  *mutable_root() = new_copy_root_node();
+  internal_copy(x.root(), root());
+  finish_copy(x.size());
+}
+
+template <typename P>
+void btree<P>::assign_packed(const self_type &x) {
+  if (&x == this) {
+    self_type tmp(key_comp(), allocator_type(internal_allocator()));
+    tmp.assign_packed(x);
+    swap(tmp);
+    return;
   }
+  clear();
+
+  *mutable_key_comp() = x.key_comp();
+  *mutable_internal_allocator() = x.internal_allocator();
+
+  size_type n = x.size();
+  if (n == 0) {
+    return;
+  }
+  // Find the lowest height whose tree can hold all of the values. A subtree
+  // of height h holds at most capacity values.
+  int height = 1;
+  for (size_type capacity = kNodeValues; capacity < n;
+       capacity = kNodeValues + (kNodeValues + 1) * capacity) {
+    ++height;
+  }
+  const_iterator iter = x.begin();
+  if (height == 1) {
+    *mutable_root() = new_leaf_root_node(n);
+    internal_build(root(), n, height, &iter);
+    return;
+  }
+  *mutable_root() = new_copy_root_node();
+  internal_build(root(), n, height, &iter);
+  finish_copy(n);
 }
 
 template <typename P>
@@ -1894,6 +2764,7 @@ typename btree<P>::iterator btree<P>::erase(iterator iter) {
       break;
     }
     if (iter.node->count() >= kMinNodeValues) {
+      update_summaries(iter.node);
       break;
     }
     bool merged = try_merge_or_rebalance(&iter);
@@ -1901,6 +2772,7 @@ typename btree<P>::iterator btree<P>::erase(iterator iter) {
       res = iter;
     }
     if (!merged) {
+      update_summaries(iter.node);
       break;
     }
     iter.node = iter.node->parent();
@@ -1921,7 +2793,7 @@ typename btree<P>::iterator btree<P>::erase(iterator iter) {
 
 template <typename P>
 int btree<P>::erase(iterator begin, iterator end) {
-  int count = distance(begin, end);
+  int count = std::distance(begin, end);
   for (int i = 0; i < count; i++) {
     begin = erase(begin);
   }
@@ -1963,7 +2835,30 @@ void btree<P>::clear() {
 template <typename P>
 void btree<P>::swap(self_type &x) {
   std::swap(static_cast<key_compare&>(*this), static_cast<key_compare&>(x));
-  std::swap(root_, x.root_);
+  // An inline root cannot change hands, so its values are moved into the
+  // inline buffer of the other btree instead.
+  bool inline_root = this->is_inline_root(root());
+  bool x_inline_root = x.is_inline_root(x.root());
+  std::swap(*mutable_internal_allocator(), *x.mutable_internal_allocator());
+  btree_swap_helper(root_.data, x.root_.data);
+  this->swap_hot_leaf(x);
+  this->swap_stats(x);
+  if (inline_root || x_inline_root) {
+    this->set_hot_leaf(NULL);
+    x.set_hot_leaf(NULL);
+    if (inline_root && x_inline_root) {
+      btree_swap_helper(*mutable_root(), *x.mutable_root());
+      root()->swap(x.root());
+    } else if (inline_root) {
+      node_type *n = x.new_leaf_root_node(1);
+      n->swap(x.root());
+      *x.mutable_root() = n;
+    } else {
+      node_type *n = new_leaf_root_node(1);
+      n->swap(root());
+      *mutable_root() = n;
+    }
+  }
 }
 
 template <typename P>
@@ -1974,6 +2869,9 @@ void btree<P>::verify() const {
     assert(rightmost() == (--const_iterator(root(), root()->count())).node);
     assert(leftmost()->leaf());
     assert(rightmost()->leaf());
+    assert(node_counts().leaf_nodes == internal_stats(root()).leaf_nodes);
+    assert(node_counts().internal_nodes ==
+           internal_stats(root()).internal_nodes);
   } else {
     assert(size() == 0);
     assert(leftmost() == NULL);
@@ -2004,6 +2902,9 @@ void btree<P>::rebalance_or_split(iterator *iter) {
         if (((insert_position - to_move) >= 0) ||
             ((left->count() + to_move) < left->max_count())) {
           left->rebalance_right_to_left(node, to_move);
+          this->mutable_stats().on_rebalance_right_to_left();
+          update_child_summary(left);
+          update_child_summary(node);
 
           assert(node->max_count() - node->count() == to_move);
           insert_position = insert_position - to_move;
@@ -2032,6 +2933,9 @@ void btree<P>::rebalance_or_split(iterator *iter) {
         if ((insert_position <= (node->count() - to_move)) ||
             ((right->count() + to_move) < right->max_count())) {
           node->rebalance_left_to_right(right, to_move);
+          this->mutable_stats().on_rebalance_left_to_right();
+          update_child_summary(node);
+          update_child_summary(right);
 
           if (insert_position > node->count()) {
             insert_position = insert_position - node->count() - 1;
@@ -2083,6 +2987,9 @@ void btree<P>::rebalance_or_split(iterator *iter) {
     split_node = new_internal_node(parent);
     node->split(split_node, insert_position);
   }
+  this->mutable_stats().on_split();
+  update_child_summary(node);
+  update_child_summary(split_node);
 
   if (insert_position > node->count()) {
     insert_position = insert_position - node->count() - 1;
@@ -2093,6 +3000,8 @@ void btree<P>::rebalance_or_split(iterator *iter) {
 template <typename P>
 void btree<P>::merge_nodes(node_type *left, node_type *right) {
   left->merge(right);
+  this->mutable_stats().on_merge();
+  update_child_summary(left);
   if (right->leaf()) {
     if (rightmost() == right) {
       *mutable_rightmost() = left;
@@ -2133,6 +3042,9 @@ bool btree<P>::try_merge_or_rebalance(iterator *iter) {
       int to_move = (right->count() - iter->node->count()) / 2;
       to_move = std::min(to_move, right->count() - 1);
       iter->node->rebalance_right_to_left(right, to_move);
+      this->mutable_stats().on_rebalance_right_to_left();
+      update_child_summary(iter->node);
+      update_child_summary(right);
       return false;
     }
   }
@@ -2148,6 +3060,9 @@ bool btree<P>::try_merge_or_rebalance(iterator *iter) {
       int to_move = (left->count() - iter->node->count()) / 2;
       to_move = std::min(to_move, left->count() - 1);
       left->rebalance_left_to_right(iter->node, to_move);
+      this->mutable_stats().on_rebalance_left_to_right();
+      update_child_summary(left);
+      update_child_summary(iter->node);
       iter->position += to_move;
       return false;
     }
@@ -2161,6 +3076,7 @@ void btree<P>::try_shrink() {
     return;
   }
   // Deleted the last item on the root node, shrink the height of the tree.
+  this->mutable_stats().on_shrink();
   if (root()->leaf()) {
     assert(size() == 0);
     delete_leaf_node(root());
@@ -2222,57 +3138,153 @@ btree<P>::internal_insert(iterator iter, const value_type &v) {
     ++*mutable_size();
   }
   iter.node->insert_value(iter.position, v);
+  update_summaries(iter.node);
   return iter;
 }
 
 template <typename P> template <typename IterType>
 inline std::pair<IterType, int> btree<P>::internal_locate(
     const key_type &key, IterType iter) const {
+  if (P::use_hot_leaf_cache::value && iter.node == root()) {
+    const node_type *leaf = this->hot_leaf();
+    if (leaf && hot_leaf_contains(leaf, key)) {
+      iter.node = this->hot_leaf();
+    }
+    std::pair<IterType, int> res =
+        internal_locate_type::dispatch(key, *this, iter);
+    // An exact match may be found on an internal node, which is not cached.
+    if (res.first.node->leaf()) {
+      this->set_hot_leaf(res.first.node);
+    }
+    return res;
+  }
   return internal_locate_type::dispatch(key, *this, iter);
 }
 
+template <typename P>
+bool btree<P>::hot_leaf_contains(
+    const node_type *leaf, const key_type &key) const {
+  if (leaf == root()) {
+    return true;
+  }
+  // The first position not less than key is on leaf iff everything before
+  // leaf is less than key and the value following leaf is greater than key.
+  // The latter is strict because the compare-to lookup expects to find an
+  // exact match on the node it searches. When leaf is at the edge of its
+  // parent we only know its own first or last key.
+  const node_type *parent = leaf->parent();
+  int pos = leaf->position();
+  if (leaf != leftmost() &&
+      (pos > 0 ? !compare_keys(parent->key(pos - 1), key)
+               : !compare_keys(leaf->key(0), key))) {
+    return false;
+  }
+  if (leaf != rightmost() &&
+      (pos < parent->count()
+           ? !compare_keys(key, parent->key(pos))
+           : compare_keys(leaf->key(leaf->count() - 1), key))) {
+    return false;
+  }
+  return true;
+}
+
 template <typename P> template <typename IterType>
 inline std::pair<IterType, int> btree<P>::internal_locate_plain_compare(
     const key_type &key, IterType iter) const {
+  int levels = 1;
   for (;;) {
-    iter.position = iter.node->lower_bound(key, key_comp());
+    iter.position = iter.node->lower_bound(key, search_comp());
     if (iter.node->leaf()) {
       break;
     }
     iter.node = iter.node->child(iter.position);
+    ++levels;
   }
+  this->mutable_stats().on_descent(levels);
   return std::make_pair(iter, 0);
 }
 
 template <typename P> template <typename IterType>
 inline std::pair<IterType, int> btree<P>::internal_locate_compare_to(
     const key_type &key, IterType iter) const {
+  int levels = 1;
   for (;;) {
-    int res = iter.node->lower_bound(key, key_comp());
+    int res = iter.node->lower_bound(key, search_comp());
     iter.position = res & kMatchMask;
     if (res & kExactMatch) {
+      this->mutable_stats().on_descent(levels);
       return std::make_pair(iter, static_cast<int>(kExactMatch));
     }
     if (iter.node->leaf()) {
       break;
     }
     iter.node = iter.node->child(iter.position);
+    ++levels;
   }
+  this->mutable_stats().on_descent(levels);
   return std::make_pair(iter, -kExactMatch);
 }
 
+template <typename P> template <typename IterType>
+IterType btree<P>::internal_locate_from(
+    const key_type &key, IterType hint) const {
+  if (!hint.node) {
+    return hint;
+  }
+  // Climb until key is known to fall between the separators bracketing the
+  // subtree on both sides. A subtree at the edge of its parent inherits the
+  // bound on that side from an ancestor, so a bound is checked at the first
+  // level where one exists. Once a bound is verified it also holds for every
+  // ancestor. When a bound does not hold, the search has to start from (at
+  // least) the parent.
+  bool lo_bracketed = false;
+  bool hi_bracketed = false;
+  for (const node_type *n = hint.node;
+       n != root() && !(lo_bracketed && hi_bracketed); n = n->parent()) {
+    int pos = n->position();
+    if (!lo_bracketed && pos > 0) {
+      if (compare_keys(n->parent()->key(pos - 1), key)) {
+        lo_bracketed = true;
+      } else {
+        hint.node = n->parent();
+      }
+    }
+    if (!hi_bracketed && pos < n->parent()->count()) {
+      if (!compare_keys(n->parent()->key(pos), key)) {
+        hi_bracketed = true;
+      } else {
+        hint.node = n->parent();
+      }
+    }
+  }
+  int levels = 1;
+  for (;;) {
+    hint.position = hint.node->lower_bound(key, search_comp()) & kMatchMask;
+    if (hint.node->leaf()) {
+      break;
+    }
+    hint.node = hint.node->child(hint.position);
+    ++levels;
+  }
+  this->mutable_stats().on_descent(levels);
+  return hint;
+}
+
 template <typename P> template <typename IterType>
 IterType btree<P>::internal_lower_bound(
     const key_type &key, IterType iter) const {
   if (iter.node) {
+    int levels = 1;
     for (;;) {
       iter.position =
-          iter.node->lower_bound(key, key_comp()) & kMatchMask;
+          iter.node->lower_bound(key, search_comp()) & kMatchMask;
       if (iter.node->leaf()) {
         break;
       }
       iter.node = iter.node->child(iter.position);
+      ++levels;
     }
+    this->mutable_stats().on_descent(levels);
     iter = internal_last(iter);
   }
   return iter;
@@ -2282,13 +3294,16 @@ template <typename P> template <typename IterType>
 IterType btree<P>::internal_upper_bound(
     const key_type &key, IterType iter) const {
   if (iter.node) {
+    int levels = 1;
     for (;;) {
-      iter.position = iter.node->upper_bound(key, key_comp());
+      iter.position = iter.node->upper_bound(key, search_comp());
       if (iter.node->leaf()) {
         break;
       }
       iter.node = iter.node->child(iter.position);
+      ++levels;
     }
+    this->mutable_stats().on_descent(levels);
     iter = internal_last(iter);
   }
   return iter;
@@ -2327,6 +3342,179 @@ IterType btree<P>::internal_find_multi(
   return IterType(NULL, 0);
 }
 
+template <typename P> template <typename IterType>
+IterType btree<P>::internal_find_from(
+    const key_type &key, IterType hint) const {
+  if (hint.node) {
+    hint = internal_last(internal_locate_from(key, hint));
+    if (hint.node && !compare_keys(key, hint.key())) {
+      return hint;
+    }
+  }
+  return IterType(NULL, 0);
+}
+
+template <typename P>
+typename btree<P>::summary_result_type
+btree<P>::node_summary(const node_type *node) const {
+  summary_result_type s = summary_type::identity();
+  if (!node->leaf()) {
+    s = node->child_summary(0);
+  }
+  for (int i = 0; i < node->count(); ++i) {
+    s = summary_type::combine(s, summary_type::value(node->value(i)));
+    if (!node->leaf()) {
+      s = summary_type::combine(s, node->child_summary(i + 1));
+    }
+  }
+  return s;
+}
+
+template <typename P> template <typename F>
+bool btree<P>::internal_for_each_span(
+    const_iterator first, const_iterator last, F &f) const {
+  while (first != last) {
+    // A leaf is visited from first to its end, or to last if that is on the
+    // same leaf. Incrementing from the final value of the run moves to the
+    // next separator, and incrementing from a separator moves to the start of
+    // the next leaf.
+    int end = first.position + 1;
+    if (first.node->leaf()) {
+      end = first.node == last.node ? last.position : first.node->count();
+    }
+    const_pointer values = &first.node->value(0);
+    if (!f(values + first.position, values + end)) {
+      return false;
+    }
+    first.position = end - 1;
+    ++first;
+  }
+  return true;
+}
+
+template <typename P> template <typename F>
+bool btree<P>::internal_for_each_span_reverse(
+    const_iterator first, const_iterator last, F &f) const {
+  while (last != first) {
+    --last;
+    int begin = last.position;
+    if (last.node->leaf()) {
+      begin = last.node == first.node ? first.position : 0;
+    }
+    const_pointer values = &last.node->value(0);
+    if (!f(values + begin, values + last.position + 1)) {
+      return false;
+    }
+    last.position = begin;
+  }
+  return true;
+}
+
+template <typename P>
+typename btree<P>::summary_result_type btree<P>::internal_aggregate(
+    const node_type *node, const key_type *lo, const key_type *hi) const {
+  int s = lo ? node->lower_bound(*lo, search_comp()) & kMatchMask : 0;
+  int e = hi ? node->lower_bound(*hi, search_comp()) & kMatchMask
+             : node->count();
+  if (node->leaf()) {
+    summary_result_type res = summary_type::identity();
+    for (int i = s; i < e; ++i) {
+      res = summary_type::combine(res, summary_type::value(node->value(i)));
+    }
+    return res;
+  }
+  if (s == e) {
+    // Both bounds fall within the same child.
+    return internal_aggregate(node->child(s), lo, hi);
+  }
+  // The children strictly between s and e are fully covered by the range so
+  // their cached summaries can be used. Children s and e are only partially
+  // covered and have a single bound each.
+  summary_result_type res = internal_aggregate(node->child(s), lo, NULL);
+  for (int i = s; i < e; ++i) {
+    res = summary_type::combine(res, summary_type::value(node->value(i)));
+    if (i + 1 < e) {
+      res = summary_type::combine(res, node->child_summary(i + 1));
+    }
+  }
+  return summary_type::combine(
+      res, internal_aggregate(node->child(e), NULL, hi));
+}
+
+template <typename P>
+typename btree<P>::node_type* btree<P>::new_copy_root_node() {
+  root_fields *p = reinterpret_cast<root_fields*>(
+      mutable_internal_allocator()->allocate(sizeof(root_fields)));
+  this->mutable_stats().on_node_allocation();
+  node_type *n = node_type::init_internal(p, NULL);
+  *n->mutable_leaf_nodes() = 0;
+  *n->mutable_internal_nodes() = 1;
+  return n;
+}
+
+template <typename P>
+void btree<P>::finish_copy(size_type size) {
+  node_type *n = root();
+  while (!n->leaf()) {
+    n = n->child(0);
+  }
+  root()->set_root_parent(n);
+  n = root();
+  while (!n->leaf()) {
+    n = n->child(n->count());
+  }
+  *mutable_rightmost() = n;
+  *mutable_size() = size;
+}
+
+template <typename P>
+void btree<P>::internal_copy(const node_type *src, node_type *dest) {
+  for (int i = 0; i < src->count(); ++i) {
+    dest->insert_value(i, src->value(i));
+  }
+  if (!src->leaf()) {
+    for (int i = 0; i <= src->count(); ++i) {
+      const node_type *src_child = src->child(i);
+      node_type *child = src_child->leaf() ?
+          new_leaf_node(dest) : new_internal_node(dest);
+      internal_copy(src_child, child);
+      dest->set_child(i, child);
+      dest->set_child_summary(i, src->child_summary(i));
+    }
+  }
+}
+
+template <typename P>
+void btree<P>::internal_build(node_type *dest, size_type n, int height,
+                              const_iterator *iter) {
+  if (height == 1) {
+    for (int i = 0; i < n; ++i, ++*iter) {
+      dest->insert_value(i, **iter);
+    }
+    return;
+  }
+  size_type child_capacity = kNodeValues;
+  for (int h = 2; h < height; ++h) {
+    child_capacity = kNodeValues + (kNodeValues + 1) * child_capacity;
+  }
+  // Use as few children as possible and share the values evenly between
+  // them, which leaves the children at least half full.
+  size_type children = (n + 1 + child_capacity) / (child_capacity + 1);
+  size_type child_values = (n - (children - 1)) / children;
+  size_type extra = (n - (children - 1)) % children;
+  for (int i = 0; i < children; ++i) {
+    node_type *child = height == 2 ?
+        new_leaf_node(dest) : new_internal_node(dest);
+    internal_build(child, child_values + (i < extra), height - 1, iter);
+    dest->set_child(i, child);
+    update_child_summary(child);
+    if (i + 1 < children) {
+      dest->insert_value(i, **iter);
+      ++*iter;
+    }
+  }
+}
+
 template <typename P>
 void btree<P>::internal_clear(node_type *node) {
   if (!node->leaf()) {
@@ -0,0 +1,467 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A btree_bitpacked_set is a set of integers for read-mostly data whose
+// values are dense, such as sets of IDs. The values are kept in sorted blocks
+// of up to BlockValues values and the blocks are indexed by a btree_map keyed
+// on the first value of each block. Each block is stored frame-of-reference
+// encoded: its first value and, for every value, the difference from the first
+// value packed into the smallest number of bits which holds the largest
+// difference. A block of 128 values spanning a range of 2000 takes 11 bits per
+// value rather than 64.
+//
+// Lookups binary search the packed differences in place, and iteration
+// decodes one value at a time, so neither unpacks a whole block. A block which
+// is modified is unpacked to a plain sorted array and stays that way, so that
+// a run of modifications to one block does not repeatedly decode and encode
+// it. compact() packs such blocks again.
+//
+// The set provides a subset of the std::set interface. Its iterators are
+// read-only, are invalidated by any modification and dereference to a value
+// rather than a reference.
+
+#ifndef UTIL_BTREE_BTREE_BITPACKED_SET_H__
+#define UTIL_BTREE_BTREE_BITPACKED_SET_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree_map.h"
+
+namespace btree {
+
+template <typename Key, int BlockValues = 128,
+          typename Alloc = std::allocator<Key> >
+class btree_bitpacked_set {
+  typedef btree_bitpacked_set<Key, BlockValues, Alloc> self_type;
+  typedef typename std::make_unsigned<Key>::type unsigned_key;
+
+  COMPILE_ASSERT(std::is_integral<Key>::value, key_must_be_integral);
+  COMPILE_ASSERT(BlockValues > 1, block_values_too_small);
+
+  typedef typename Alloc::template rebind<uint64_t>::other word_allocator;
+  typedef typename Alloc::template rebind<Key>::other key_allocator;
+
+  // A sorted block of values, either bit packed or plain.
+  class block {
+   public:
+    block()
+        : base_(0),
+          count_(0),
+          bits_(0),
+          packed_(true) {
+    }
+
+    int count() const { return count_; }
+    bool packed() const { return packed_; }
+
+    // Returns the value at position i.
+    Key value(int i) const {
+      if (!packed_) {
+        return values_[i];
+      }
+      if (bits_ == 0) {
+        return base_;
+      }
+      size_t bit = size_t(i) * bits_;
+      size_t word = bit / 64;
+      int shift = int(bit % 64);
+      uint64_t v = words_[word] >> shift;
+      if (shift + bits_ > 64) {
+        v |= words_[word + 1] << (64 - shift);
+      }
+      if (bits_ < 64) {
+        v &= (uint64_t(1) << bits_) - 1;
+      }
+      return Key(unsigned_key(unsigned_key(base_) + unsigned_key(v)));
+    }
+
+    // Returns the position of the first value not less than k.
+    int lower_bound(Key k) const {
+      if (!packed_) {
+        return int(std::lower_bound(values_.begin(), values_.end(), k) -
+                   values_.begin());
+      }
+      int s = 0, e = count_;
+      while (s != e) {
+        int mid = (s + e) / 2;
+        if (value(mid) < k) {
+          s = mid + 1;
+        } else {
+          e = mid;
+        }
+      }
+      return s;
+    }
+
+    // Appends the values of the block to *out.
+    void decode(std::vector<Key, key_allocator> *out) const {
+      if (!packed_) {
+        out->insert(out->end(), values_.begin(), values_.end());
+        return;
+      }
+      size_t n = out->size();
+      out->resize(n + count_);
+      for (int i = 0; i < count_; ++i) {
+        (*out)[n + i] = value(i);
+      }
+    }
+
+    // Sets the contents of the block to the sorted values [b, e), packed.
+    template <typename Iter>
+    void pack(Iter b, Iter e) {
+      count_ = int(e - b);
+      base_ = count_ > 0 ? *b : Key(0);
+      unsigned_key range = count_ > 0 ?
+          unsigned_key(unsigned_key(*(e - 1)) - unsigned_key(base_)) : 0;
+      bits_ = 0;
+      while (bits_ < 64 && (range >> bits_) != 0) {
+        ++bits_;
+      }
+      words_.assign((size_t(count_) * bits_ + 63) / 64, 0);
+      for (int i = 0; i < count_; ++i, ++b) {
+        uint64_t v = unsigned_key(unsigned_key(*b) - unsigned_key(base_));
+        size_t bit = size_t(i) * bits_;
+        size_t word = bit / 64;
+        int shift = int(bit % 64);
+        if (bits_ > 0) {
+          words_[word] |= v << shift;
+          if (shift + bits_ > 64) {
+            words_[word + 1] |= v >> (64 - shift);
+          }
+        }
+      }
+      std::vector<Key, key_allocator>().swap(values_);
+      packed_ = true;
+    }
+
+    // Returns the plain values of the block for modification, unpacking it
+    // if necessary. The caller must keep the values sorted and call
+    // update_count() afterwards.
+    std::vector<Key, key_allocator>* mutable_values() {
+      if (packed_) {
+        values_.reserve(count_ + 1);
+        decode(&values_);
+        std::vector<uint64_t, word_allocator>().swap(words_);
+        packed_ = false;
+      }
+      return &values_;
+    }
+    void update_count() {
+      count_ = int(values_.size());
+      base_ = count_ > 0 ? values_[0] : Key(0);
+    }
+
+    // The number of bytes of heap memory used by the block.
+    size_t bytes_used() const {
+      return words_.capacity() * sizeof(uint64_t) +
+          values_.capacity() * sizeof(Key);
+    }
+
+    void swap(block &x) {
+      std::swap(base_, x.base_);
+      std::swap(count_, x.count_);
+      std::swap(bits_, x.bits_);
+      std::swap(packed_, x.packed_);
+      words_.swap(x.words_);
+      values_.swap(x.values_);
+    }
+    friend void swap(block &a, block &b) { a.swap(b); }
+
+   private:
+    Key base_;
+    int count_;
+    int bits_;
+    bool packed_;
+    // The packed differences from base_, valid when packed_.
+    std::vector<uint64_t, word_allocator> words_;
+    // The values, valid when !packed_.
+    std::vector<Key, key_allocator> values_;
+  };
+
+  typedef typename Alloc::template rebind<
+    std::pair<const Key, block> >::other block_allocator;
+  typedef btree_map<Key, block, std::less<Key>, block_allocator> block_map;
+  typedef typename block_map::iterator block_iterator;
+  typedef typename block_map::const_iterator block_const_iterator;
+
+ public:
+  typedef Key key_type;
+  typedef Key value_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef Alloc allocator_type;
+
+  class const_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Key value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const Key* pointer;
+    typedef Key reference;
+
+    const_iterator()
+        : position_(0) {
+    }
+
+    Key operator*() const { return block_->second.value(position_); }
+
+    const_iterator& operator++() {
+      if (++position_ == block_->second.count()) {
+        ++block_;
+        position_ = 0;
+      }
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+
+    bool operator==(const const_iterator &x) const {
+      return block_ == x.block_ && position_ == x.position_;
+    }
+    bool operator!=(const const_iterator &x) const {
+      return !(*this == x);
+    }
+
+   private:
+    friend class btree_bitpacked_set;
+    const_iterator(block_const_iterator b, int position)
+        : block_(b),
+          position_(position) {
+    }
+
+    block_const_iterator block_;
+    int position_;
+  };
+  typedef const_iterator iterator;
+
+ public:
+  btree_bitpacked_set(const allocator_type &alloc = allocator_type())
+      : blocks_(std::less<Key>(), block_allocator(alloc)),
+        size_(0) {
+  }
+  // Builds the set from the values [b, e), which need not be sorted.
+  template <typename InputIterator>
+  btree_bitpacked_set(InputIterator b, InputIterator e,
+                      const allocator_type &alloc = allocator_type())
+      : blocks_(std::less<Key>(), block_allocator(alloc)),
+        size_(0) {
+    assign(b, e);
+  }
+
+  // Replaces the contents of the set with the values [b, e), which need not
+  // be sorted. The blocks are filled and packed.
+  template <typename InputIterator>
+  void assign(InputIterator b, InputIterator e) {
+    std::vector<Key, key_allocator> values(b, e);
+    if (!std::is_sorted(values.begin(), values.end())) {
+      std::sort(values.begin(), values.end());
+    }
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    clear();
+    for (size_t i = 0; i < values.size(); i += BlockValues) {
+      size_t n = std::min<size_t>(BlockValues, values.size() - i);
+      block_iterator it =
+          blocks_.insert(blocks_.end(), std::make_pair(values[i], block()));
+      it->second.pack(values.begin() + i, values.begin() + i + n);
+    }
+    size_ = values.size();
+  }
+
+  // Iterator routines.
+  const_iterator begin() const {
+    return const_iterator(blocks_.begin(), 0);
+  }
+  const_iterator end() const {
+    return const_iterator(blocks_.end(), 0);
+  }
+
+  // Lookup routines.
+  const_iterator lower_bound(Key k) const {
+    block_const_iterator it = find_block(k);
+    if (it == blocks_.end()) {
+      return begin();
+    }
+    int pos = it->second.lower_bound(k);
+    if (pos == it->second.count()) {
+      return const_iterator(++it, 0);
+    }
+    return const_iterator(it, pos);
+  }
+  const_iterator find(Key k) const {
+    const_iterator it = lower_bound(k);
+    return (it != end() && *it == k) ? it : end();
+  }
+  size_type count(Key k) const {
+    return find(k) != end();
+  }
+
+  // Insertion routines. Returns true if k was not already in the set.
+  bool insert(Key k) {
+    block_iterator it = find_block(k);
+    if (it == blocks_.end()) {
+      if (blocks_.empty()) {
+        it = blocks_.insert(std::make_pair(k, block())).first;
+      } else {
+        it = blocks_.begin();
+      }
+    }
+    std::vector<Key, key_allocator> *values = it->second.mutable_values();
+    typename std::vector<Key, key_allocator>::iterator pos =
+        std::lower_bound(values->begin(), values->end(), k);
+    if (pos != values->end() && *pos == k) {
+      return false;
+    }
+    values->insert(pos, k);
+    ++size_;
+    if (values->size() > size_t(2 * BlockValues)) {
+      split_block(it);
+    } else {
+      update_block(it);
+    }
+    return true;
+  }
+  template <typename InputIterator>
+  void insert(InputIterator b, InputIterator e) {
+    for (; b != e; ++b) {
+      insert(*b);
+    }
+  }
+
+  // Deletion routines. Returns the number of values erased.
+  size_type erase(Key k) {
+    block_iterator it = find_block(k);
+    if (it == blocks_.end()) {
+      return 0;
+    }
+    int pos = it->second.lower_bound(k);
+    if (pos == it->second.count() || it->second.value(pos) != k) {
+      return 0;
+    }
+    std::vector<Key, key_allocator> *values = it->second.mutable_values();
+    values->erase(std::lower_bound(values->begin(), values->end(), k));
+    --size_;
+    update_block(it);
+    return 1;
+  }
+
+  // Utility routines.
+  void clear() {
+    blocks_.clear();
+    size_ = 0;
+  }
+  void swap(self_type &x) {
+    blocks_.swap(x.blocks_);
+    std::swap(size_, x.size_);
+  }
+  // Rebuilds the set with full, packed blocks. Packs the blocks unpacked by
+  // modifications and merges blocks left small by erasures.
+  void compact() {
+    std::vector<Key, key_allocator> values;
+    values.reserve(size_);
+    for (block_const_iterator it = blocks_.begin(); it != blocks_.end();
+         ++it) {
+      it->second.decode(&values);
+    }
+    assign(values.begin(), values.end());
+  }
+
+  // Size routines.
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // The number of blocks, and the number of those which are not packed.
+  size_type blocks() const { return blocks_.size(); }
+  size_type unpacked_blocks() const {
+    size_type n = 0;
+    for (block_const_iterator it = blocks_.begin(); it != blocks_.end();
+         ++it) {
+      n += !it->second.packed();
+    }
+    return n;
+  }
+  // The total number of bytes used by the set.
+  size_type bytes_used() const {
+    size_type n = sizeof(*this) - sizeof(blocks_) + blocks_.bytes_used();
+    for (block_const_iterator it = blocks_.begin(); it != blocks_.end();
+         ++it) {
+      n += it->second.bytes_used();
+    }
+    return n;
+  }
+
+ private:
+  // Returns the block which would hold k: the last block whose first value is
+  // not greater than k, or end() if k precedes every block.
+  block_iterator find_block(Key k) {
+    block_iterator it = blocks_.upper_bound(k);
+    return it == blocks_.begin() ? blocks_.end() : --it;
+  }
+  block_const_iterator find_block(Key k) const {
+    block_const_iterator it = blocks_.upper_bound(k);
+    return it == blocks_.begin() ? blocks_.end() : --it;
+  }
+
+  // Updates the block at it after its values were modified, keeping its key
+  // equal to its first value and removing it if it is empty.
+  void update_block(block_iterator it) {
+    it->second.update_count();
+    if (it->second.count() == 0) {
+      blocks_.erase(it);
+    } else if (it->first != it->second.value(0)) {
+      block b;
+      b.swap(it->second);
+      blocks_.erase(it);
+      Key first = b.value(0);
+      blocks_.insert(std::make_pair(first, block())).first->second.swap(b);
+    }
+  }
+
+  // Splits the oversized plain block at it into two plain blocks.
+  void split_block(block_iterator it) {
+    std::vector<Key, key_allocator> *values = it->second.mutable_values();
+    size_t half = values->size() / 2;
+    block right;
+    std::vector<Key, key_allocator> *right_values = right.mutable_values();
+    right_values->assign(values->begin() + half, values->end());
+    right.update_count();
+    values->resize(half);
+    update_block(it);
+    Key first = right.value(0);
+    blocks_.insert(std::make_pair(first, block())).first->second.swap(right);
+  }
+
+ private:
+  block_map blocks_;
+  size_type size_;
+};
+
+template <typename K, int N, typename A>
+inline void swap(btree_bitpacked_set<K, N, A> &x,
+                 btree_bitpacked_set<K, N, A> &y) {
+  x.swap(y);
+}
+
+} // namespace btree
+
+#endif  // UTIL_BTREE_BTREE_BITPACKED_SET_H__
@@ -19,6 +19,7 @@
 #include <utility>
 
 #include "btree.h"
+#include "btree_frozen.h"
 
 namespace btree {
 
@@ -44,6 +45,9 @@ class btree_container {
   typedef typename Tree::const_iterator const_iterator;
   typedef typename Tree::reverse_iterator reverse_iterator;
   typedef typename Tree::const_reverse_iterator const_reverse_iterator;
+  typedef typename Tree::summary_result_type summary_result_type;
+  typedef typename Tree::stats_type stats_type;
+  typedef btree_frozen<params_type> frozen_type;
 
  public:
   // Default constructor.
@@ -73,6 +77,12 @@ class btree_container {
   const_iterator lower_bound(const key_type &key) const {
     return tree_.lower_bound(key);
   }
+  iterator lower_bound(iterator hint, const key_type &key) {
+    return tree_.lower_bound(hint, key);
+  }
+  const_iterator lower_bound(const_iterator hint, const key_type &key) const {
+    return tree_.lower_bound(hint, key);
+  }
   iterator upper_bound(const key_type &key) {
     return tree_.upper_bound(key);
   }
@@ -86,6 +96,36 @@ class btree_container {
     return tree_.equal_range(key);
   }
 
+  // Summary routines. See btree_no_summary.
+  summary_result_type aggregate(const key_type &lo, const key_type &hi) const {
+    return tree_.aggregate(lo, hi);
+  }
+  summary_result_type aggregate() const {
+    return tree_.aggregate();
+  }
+  void update_summary(iterator iter) {
+    tree_.update_summary(iter);
+  }
+
+  // Span routines. See btree::for_each_span().
+  template <typename F>
+  bool for_each_span(const key_type &lo, const key_type &hi, F f) const {
+    return tree_.for_each_span(lo, hi, f);
+  }
+  template <typename F>
+  bool for_each_span(F f) const {
+    return tree_.for_each_span(f);
+  }
+  template <typename F>
+  bool for_each_span_reverse(
+      const key_type &lo, const key_type &hi, F f) const {
+    return tree_.for_each_span_reverse(lo, hi, f);
+  }
+  template <typename F>
+  bool for_each_span_reverse(F f) const {
+    return tree_.for_each_span_reverse(f);
+  }
+
   // Utility routines.
   void clear() {
     tree_.clear();
@@ -93,6 +133,16 @@ class btree_container {
   void swap(self_type &x) {
     tree_.swap(x.tree_);
   }
+  // Makes this container a copy of x with full leaves. See
+  // btree::assign_packed().
+  void assign_packed(const self_type &x) {
+    tree_.assign_packed(x.tree_);
+  }
+  // Returns an immutable copy of the container laid out for fast lookups.
+  // See btree_frozen.
+  frozen_type freeze(const allocator_type &alloc = allocator_type()) const {
+    return frozen_type(begin(), end(), tree_.key_comp(), alloc);
+  }
   void dump(std::ostream &os) const {
     tree_.dump(os);
   }
@@ -114,6 +164,7 @@ class btree_container {
   }
   double fullness() const { return tree_.fullness(); }
   double overhead() const { return tree_.overhead(); }
+  const stats_type& stats() const { return tree_.stats(); }
 
   bool operator==(const self_type& x) const {
     if (size() != x.size()) {
@@ -185,6 +236,12 @@ class btree_unique_container : public btree_container<Tree> {
   const_iterator find(const key_type &key) const {
     return this->tree_.find_unique(key);
   }
+  iterator find(iterator hint, const key_type &key) {
+    return this->tree_.find(hint, key);
+  }
+  const_iterator find(const_iterator hint, const key_type &key) const {
+    return this->tree_.find(hint, key);
+  }
   size_type count(const key_type &key) const {
     return this->tree_.count_unique(key);
   }
@@ -313,6 +370,12 @@ class btree_multi_container : public btree_container<Tree> {
   const_iterator find(const key_type &key) const {
     return this->tree_.find_multi(key);
   }
+  iterator find(iterator hint, const key_type &key) {
+    return this->tree_.find(hint, key);
+  }
+  const_iterator find(const_iterator hint, const key_type &key) const {
+    return this->tree_.find(hint, key);
+  }
   size_type count(const key_type &key) const {
     return this->tree_.count_multi(key);
   }
@@ -0,0 +1,347 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A btree_frozen is an immutable copy of a btree container for data which is
+// built once and then only read. It is created by the freeze() method of the
+// btree containers and provides their read-only interface: iteration,
+// find(), count(), lower_bound(), upper_bound() and equal_range().
+//
+// The values are stored in a single array in Eytzinger (breadth-first binary
+// heap) order: the value at position k, counting from 1, has its children at
+// positions 2k and 2k+1. There are no parent pointers, child pointers or node
+// headers, so the array holds nothing but values, and a lookup computes the
+// position of the next value to compare arithmetically. The 16 descendants
+// of position k four levels down are adjacent at positions [16k, 16k + 16),
+// which lets a lookup prefetch them while it compares the intervening levels.
+// A lookup compares log2(n) values, like a binary search of a sorted array,
+// but touches far fewer cache lines once the array exceeds the cache.
+//
+// Iterators step between positions in sorted order arithmetically as well.
+// The frozen copy does not refer to the container it was made from.
+
+#ifndef UTIL_BTREE_BTREE_FROZEN_H__
+#define UTIL_BTREE_BTREE_FROZEN_H__
+
+#include <stddef.h>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+
+namespace btree {
+
+// Hints that the cache line at p will be read soon.
+inline void btree_prefetch(const void *p) {
+#if defined(__GNUC__)
+  __builtin_prefetch(p);
+#endif
+}
+
+// An iterator over a btree_frozen, which visits its values in sorted order.
+// The iterator refers to a position in the frozen array; position 0 is end().
+template <typename Frozen>
+class btree_frozen_iterator {
+  typedef btree_frozen_iterator<Frozen> self_type;
+  template <typename P> friend class btree_frozen;
+
+ public:
+  typedef typename Frozen::value_type value_type;
+  typedef typename Frozen::size_type size_type;
+  typedef typename Frozen::difference_type difference_type;
+  typedef typename Frozen::const_pointer pointer;
+  typedef typename Frozen::const_reference reference;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  btree_frozen_iterator()
+      : values_(NULL), size_(0), position_(0) {
+  }
+  btree_frozen_iterator(pointer values, size_type size, size_type position)
+      : values_(values), size_(size), position_(position) {
+  }
+
+  bool operator==(const self_type &x) const {
+    return position_ == x.position_;
+  }
+  bool operator!=(const self_type &x) const {
+    return position_ != x.position_;
+  }
+
+  reference operator*() const { return values_[position_ - 1]; }
+  pointer operator->() const { return &values_[position_ - 1]; }
+
+  self_type& operator++() {
+    increment();
+    return *this;
+  }
+  self_type& operator--() {
+    decrement();
+    return *this;
+  }
+  self_type operator++(int) {
+    self_type tmp = *this;
+    ++*this;
+    return tmp;
+  }
+  self_type operator--(int) {
+    self_type tmp = *this;
+    --*this;
+    return tmp;
+  }
+
+ private:
+  // Moves to the leftmost position of the subtree of the right child if there
+  // is one. Otherwise moves up to the first ancestor whose left subtree holds
+  // the current position, or to end() if there is none.
+  void increment() {
+    if (2 * position_ + 1 <= size_) {
+      position_ = 2 * position_ + 1;
+      while (2 * position_ <= size_) {
+        position_ = 2 * position_;
+      }
+    } else {
+      while (position_ & 1) {
+        position_ >>= 1;
+      }
+      position_ >>= 1;
+    }
+  }
+  // The mirror image of increment(). Decrementing end() moves to the
+  // rightmost position.
+  void decrement() {
+    if (position_ == 0) {
+      position_ = 1;
+      while (2 * position_ + 1 <= size_) {
+        position_ = 2 * position_ + 1;
+      }
+    } else if (2 * position_ <= size_) {
+      position_ = 2 * position_;
+      while (2 * position_ + 1 <= size_) {
+        position_ = 2 * position_ + 1;
+      }
+    } else {
+      while (position_ > 1 && !(position_ & 1)) {
+        position_ >>= 1;
+      }
+      position_ >>= 1;
+    }
+  }
+
+ private:
+  pointer values_;
+  size_type size_;
+  size_type position_;
+};
+
+template <typename Params>
+class btree_frozen : private Params::key_compare {
+  typedef btree_frozen<Params> self_type;
+
+  enum {
+    // A lookup prefetches the descendants this many levels below the position
+    // it is comparing. 2^kPrefetchLevels values are adjacent at that depth.
+    kPrefetchLevels = 4,
+  };
+
+ public:
+  typedef Params params_type;
+  typedef typename Params::key_type key_type;
+  typedef typename Params::data_type data_type;
+  typedef typename Params::mapped_type mapped_type;
+  typedef typename Params::value_type value_type;
+  typedef typename Params::key_compare key_compare;
+  typedef typename Params::const_pointer const_pointer;
+  typedef typename Params::const_reference const_reference;
+  typedef typename Params::allocator_type allocator_type;
+  typedef typename Params::size_type size_type;
+  typedef typename Params::difference_type difference_type;
+  typedef btree_frozen_iterator<self_type> const_iterator;
+  typedef const_iterator iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+  typedef const_reverse_iterator reverse_iterator;
+
+ public:
+  // Creates an empty frozen container.
+  explicit btree_frozen(const key_compare &comp = key_compare(),
+                        const allocator_type &alloc = allocator_type())
+      : key_compare(comp),
+        values_(alloc) {
+  }
+
+  // Creates a frozen container holding the sorted range [b, e). The values
+  // referred to by the range must stay valid until the constructor returns.
+  template <typename ForwardIterator>
+  btree_frozen(ForwardIterator b, ForwardIterator e,
+               const key_compare &comp = key_compare(),
+               const allocator_type &alloc = allocator_type())
+      : key_compare(comp),
+        values_(alloc) {
+    build(b, e);
+  }
+
+  // Iterator routines.
+  const_iterator begin() const { return make_iterator(leftmost(size())); }
+  const_iterator end() const { return make_iterator(0); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+
+  // Lookup routines.
+  const_iterator lower_bound(const key_type &key) const {
+    const_pointer values = data();
+    const size_type n = size();
+    size_type k = 1;
+    while (k <= n) {
+      prefetch(k);
+      // Descend right past values less than key.
+      k = 2 * k + compare_keys(params_type::key(values[k - 1]), key);
+    }
+    return make_iterator(ancestor(k));
+  }
+  const_iterator upper_bound(const key_type &key) const {
+    const_pointer values = data();
+    const size_type n = size();
+    size_type k = 1;
+    while (k <= n) {
+      prefetch(k);
+      // Descend right past values not greater than key.
+      k = 2 * k + !compare_keys(key, params_type::key(values[k - 1]));
+    }
+    return make_iterator(ancestor(k));
+  }
+  std::pair<const_iterator, const_iterator> equal_range(
+      const key_type &key) const {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+  const_iterator find(const key_type &key) const {
+    const_iterator iter = lower_bound(key);
+    if (iter != end() && !compare_keys(key, params_type::key(*iter))) {
+      return iter;
+    }
+    return end();
+  }
+  size_type count(const key_type &key) const {
+    std::pair<const_iterator, const_iterator> range = equal_range(key);
+    return std::distance(range.first, range.second);
+  }
+
+  // Utility routines.
+  void clear() {
+    values_.clear();
+  }
+  void swap(self_type &x) {
+    btree_swap_helper(static_cast<key_compare&>(*this),
+                      static_cast<key_compare&>(x));
+    values_.swap(x.values_);
+  }
+  const key_compare& key_comp() const {
+    return *this;
+  }
+
+  // Size routines.
+  size_type size() const { return values_.size(); }
+  size_type max_size() const { return values_.max_size(); }
+  bool empty() const { return values_.empty(); }
+
+  // The number of bytes used by the frozen container.
+  size_type bytes_used() const {
+    return sizeof(*this) + values_.capacity() * sizeof(value_type);
+  }
+
+  bool operator==(const self_type &x) const {
+    return size() == x.size() && std::equal(begin(), end(), x.begin());
+  }
+  bool operator!=(const self_type &x) const {
+    return !operator==(x);
+  }
+
+ private:
+  typedef typename allocator_type::template rebind<value_type>::other
+    value_allocator;
+  typedef std::vector<value_type, value_allocator> value_vector;
+
+  bool compare_keys(const key_type &x, const key_type &y) const {
+    return btree_compare_keys(key_comp(), x, y);
+  }
+  const_pointer data() const {
+    return values_.empty() ? NULL : &values_[0];
+  }
+  const_iterator make_iterator(size_type k) const {
+    return const_iterator(data(), size(), k);
+  }
+
+  // Prefetches the values kPrefetchLevels below position k.
+  void prefetch(size_type k) const {
+    const size_type descendant = k << kPrefetchLevels;
+    if (descendant <= size()) {
+      btree_prefetch(&values_[descendant - 1]);
+    }
+  }
+
+  // Returns the position of the smallest of n values, or 0 if n is 0.
+  static size_type leftmost(size_type n) {
+    if (n == 0) {
+      return 0;
+    }
+    size_type k = 1;
+    while (2 * k <= n) {
+      k = 2 * k;
+    }
+    return k;
+  }
+
+  // A lookup which descends past the bottom of the tree ends at a position
+  // below a leaf which records the path taken: a 1 bit for each step right.
+  // The result is the last position from which the lookup stepped left,
+  // found by discarding the trailing steps right and the final step left.
+  static size_type ancestor(size_type k) {
+    while (k & 1) {
+      k >>= 1;
+    }
+    return k >> 1;
+  }
+
+  // Fills values_ with the sorted range [b, e) in Eytzinger order. The
+  // positions are visited in sorted order by an iterator over the array
+  // being built, recording where each value belongs.
+  template <typename ForwardIterator>
+  void build(ForwardIterator b, ForwardIterator e) {
+    const size_type n = std::distance(b, e);
+    std::vector<const value_type*> order(n);
+    const_iterator iter(NULL, n, leftmost(n));
+    for (; b != e; ++b, ++iter) {
+      order[iter.position_ - 1] = &*b;
+    }
+    values_.reserve(n);
+    for (size_type i = 0; i < n; ++i) {
+      values_.push_back(*order[i]);
+    }
+  }
+
+ private:
+  value_vector values_;
+};
+
+template <typename P>
+inline void swap(btree_frozen<P> &x, btree_frozen<P> &y) {
+  x.swap(y);
+}
+
+} // namespace btree
+
+#endif  // UTIL_BTREE_BTREE_FROZEN_H__
@@ -0,0 +1,268 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A btree_node_arena is a fixed-capacity region of memory from which the nodes
+// of one or more btrees are allocated through a btree_arena_allocator. Keeping
+// the nodes of a btree within a region smaller than 2GB is what allows
+// btree_compressed_node_params to use 32-bit relative pointers between nodes.
+// btree_relocatable_params uses 64-bit relative pointers and places no limit
+// on the size of the region.
+//
+// The arena carves nodes off the front of the region and keeps a free list
+// for each distinct allocation size, which suits btrees: they only allocate a
+// handful of node sizes. All of the arena's bookkeeping lives at the start of
+// the region and refers to blocks by their offset in the region, so a region
+// may be copied, or shared between processes which map it at different
+// addresses, and attached to by another btree_node_arena. The arena also
+// records the offset of one root object, such as a btree which lives in the
+// region, so that whoever attaches to the region can find it.
+
+#ifndef UTIL_BTREE_BTREE_NODE_ARENA_H__
+#define UTIL_BTREE_BTREE_NODE_ARENA_H__
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+
+namespace btree {
+
+class btree_node_arena {
+  // The number of distinct allocation sizes which are recycled. Blocks of any
+  // further sizes are not reused once deallocated.
+  enum { kSizeClasses = 32 };
+
+  // Identifies a region holding an arena.
+  enum { kMagic = 0x62747265 };
+
+  struct free_list {
+    uint64_t size;
+    // The offset of the first free block, or 0 if there is none. A free block
+    // holds the offset of the next free block in its first 8 bytes.
+    uint64_t head;
+  };
+
+  struct header {
+    uint32_t magic;
+    uint64_t capacity;
+    // The offset of the first byte which has never been allocated.
+    uint64_t top;
+    // The number of bytes in allocated blocks.
+    uint64_t used;
+    // The offset of the root object, or 0 if there is none.
+    uint64_t root;
+    free_list free_lists[kSizeClasses];
+  };
+
+ public:
+  enum {
+    // The alignment of every block returned by allocate().
+    kAlignment = alignof(max_align_t),
+  };
+
+  // How the constructor treats a caller-supplied region.
+  enum init_mode {
+    // Creates a new, empty arena in the region.
+    kCreate,
+    // Attaches to the arena already in the region, which was created by
+    // another btree_node_arena, possibly in another process or at another
+    // address.
+    kAttach,
+  };
+
+  // Creates an arena owning a newly allocated region of capacity bytes.
+  explicit btree_node_arena(size_t capacity)
+      : header_(static_cast<header*>(::operator new(capacity))),
+        owned_(true) {
+    init(capacity);
+  }
+  // Creates or attaches to an arena in the caller-supplied region [region,
+  // region + capacity), which must be aligned to kAlignment and outlive the
+  // arena.
+  btree_node_arena(void *region, size_t capacity, init_mode mode = kCreate)
+      : header_(static_cast<header*>(region)),
+        owned_(false) {
+    assert(reinterpret_cast<uintptr_t>(region) % kAlignment == 0);
+    if (mode == kCreate) {
+      init(capacity);
+    } else {
+      assert(header_->magic == kMagic);
+      assert(header_->capacity == capacity);
+    }
+  }
+  ~btree_node_arena() {
+    if (owned_) {
+      ::operator delete(header_);
+    }
+  }
+
+  // Allocates n bytes aligned to kAlignment. Throws std::bad_alloc if the
+  // arena is exhausted.
+  void* allocate(size_t n) {
+    n = round_up(n);
+    free_list *l = find_free_list(n);
+    if (l && l->head) {
+      char *p = base() + l->head;
+      memcpy(&l->head, p, sizeof(l->head));
+      header_->used += n;
+      return p;
+    }
+    if (n > header_->capacity - header_->top) {
+      throw std::bad_alloc();
+    }
+    char *p = base() + header_->top;
+    header_->top += n;
+    header_->used += n;
+    return p;
+  }
+
+  // Returns a block of n bytes obtained from allocate(n) to the arena.
+  void deallocate(void *p, size_t n) {
+    n = round_up(n);
+    assert(static_cast<char*>(p) > base() &&
+           static_cast<char*>(p) + n <= base() + header_->top);
+    header_->used -= n;
+    free_list *l = find_free_list(n);
+    if (l) {
+      memcpy(p, &l->head, sizeof(l->head));
+      l->head = uint64_t(static_cast<char*>(p) - base());
+    }
+  }
+
+  // The root object of the region, or NULL if none has been set.
+  void* root_object() const {
+    return header_->root ? base() + header_->root : NULL;
+  }
+  // Sets the root object of the region to p, which must be a block of the
+  // arena, or NULL.
+  void set_root_object(void *p) {
+    assert(p == NULL || (static_cast<char*>(p) > base() &&
+                         static_cast<char*>(p) < base() + header_->top));
+    header_->root = p ? uint64_t(static_cast<char*>(p) - base()) : 0;
+  }
+
+  // The region holding the arena and its blocks.
+  void* region() const { return header_; }
+  // The size of the region in bytes.
+  size_t capacity() const { return header_->capacity; }
+  // The number of bytes in allocated blocks.
+  size_t bytes_used() const { return header_->used; }
+  // The number of bytes of the region which have ever been allocated,
+  // including the arena's own bookkeeping and blocks on the free lists.
+  size_t bytes_reserved() const { return header_->top; }
+
+ private:
+  static size_t round_up(size_t n) {
+    return (n + kAlignment - 1) / kAlignment * kAlignment;
+  }
+
+  char* base() const { return reinterpret_cast<char*>(header_); }
+
+  void init(size_t capacity) {
+    assert(capacity >= round_up(sizeof(header)));
+    memset(header_, 0, sizeof(header));
+    header_->magic = kMagic;
+    header_->capacity = capacity;
+    header_->top = round_up(sizeof(header));
+  }
+
+  // Returns the free list for blocks of size n, claiming an unused free list
+  // if necessary. Returns NULL if all of the free lists are in use.
+  free_list* find_free_list(size_t n) {
+    for (int i = 0; i < kSizeClasses; ++i) {
+      free_list *l = &header_->free_lists[i];
+      if (l->size == n) {
+        return l;
+      }
+      if (l->size == 0) {
+        l->size = n;
+        return l;
+      }
+    }
+    return NULL;
+  }
+
+ private:
+  header *header_;
+  bool owned_;
+
+ private:
+  btree_node_arena(const btree_node_arena&);
+  void operator=(const btree_node_arena&);
+};
+
+// An STL allocator which allocates from a btree_node_arena. Allocators
+// compare equal if they share an arena.
+template <typename T>
+class btree_arena_allocator {
+ public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef btree_arena_allocator<U> other;
+  };
+
+  explicit btree_arena_allocator(btree_node_arena *arena)
+      : arena_(arena) {
+  }
+  template <typename U>
+  btree_arena_allocator(const btree_arena_allocator<U> &x)
+      : arena_(x.arena()) {
+  }
+
+  pointer allocate(size_type n, const void *hint = 0) {
+    return static_cast<pointer>(arena_->allocate(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type n) {
+    arena_->deallocate(p, n * sizeof(T));
+  }
+  size_type max_size() const {
+    return arena_->capacity() / sizeof(T);
+  }
+  void construct(pointer p, const T &v) {
+    new (p) T(v);
+  }
+  void destroy(pointer p) {
+    p->~T();
+  }
+
+  btree_node_arena* arena() const { return arena_; }
+
+ private:
+  btree_node_arena *arena_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const btree_arena_allocator<T> &a,
+                       const btree_arena_allocator<U> &b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const btree_arena_allocator<T> &a,
+                       const btree_arena_allocator<U> &b) {
+  return a.arena() != b.arena();
+}
+
+} // namespace btree
+
+#endif  // UTIL_BTREE_BTREE_NODE_ARENA_H__
@@ -187,6 +187,8 @@ class safe_btree {
   typedef typename btree_type::const_reference const_reference;
   typedef typename btree_type::size_type size_type;
   typedef typename btree_type::difference_type difference_type;
+  typedef typename btree_type::summary_result_type summary_result_type;
+  typedef typename btree_type::stats_type stats_type;
   typedef safe_btree_iterator<self_type, tree_iterator> iterator;
   typedef safe_btree_iterator<
     const self_type, tree_const_iterator> const_iterator;
@@ -244,6 +246,13 @@ class safe_btree {
   const_iterator upper_bound(const key_type &key) const {
     return const_iterator(this, tree_.upper_bound(key));
   }
+  iterator lower_bound(const iterator &hint, const key_type &key) {
+    return iterator(this, tree_.lower_bound(hint.iter(), key));
+  }
+  const_iterator lower_bound(const const_iterator &hint,
+                             const key_type &key) const {
+    return const_iterator(this, tree_.lower_bound(hint.iter(), key));
+  }
   std::pair<iterator, iterator> equal_range(const key_type &key) {
     std::pair<tree_iterator, tree_iterator> p = tree_.equal_range(key);
     return std::make_pair(iterator(this, p.first),
@@ -266,6 +275,12 @@ class safe_btree {
   const_iterator find_multi(const key_type &key) const {
     return const_iterator(this, tree_.find_multi(key));
   }
+  iterator find(const iterator &hint, const key_type &key) {
+    return iterator(this, tree_.find(hint.iter(), key));
+  }
+  const_iterator find(const const_iterator &hint, const key_type &key) const {
+    return const_iterator(this, tree_.find(hint.iter(), key));
+  }
   size_type count_unique(const key_type &key) const {
     return tree_.count_unique(key);
   }
@@ -273,6 +288,36 @@ class safe_btree {
     return tree_.count_multi(key);
   }
 
+  // Summary routines.
+  summary_result_type aggregate(const key_type &lo, const key_type &hi) const {
+    return tree_.aggregate(lo, hi);
+  }
+  summary_result_type aggregate() const {
+    return tree_.aggregate();
+  }
+  void update_summary(const iterator &iter) {
+    tree_.update_summary(iter.iter());
+  }
+
+  // Span routines.
+  template <typename F>
+  bool for_each_span(const key_type &lo, const key_type &hi, F f) const {
+    return tree_.for_each_span(lo, hi, f);
+  }
+  template <typename F>
+  bool for_each_span(F f) const {
+    return tree_.for_each_span(f);
+  }
+  template <typename F>
+  bool for_each_span_reverse(
+      const key_type &lo, const key_type &hi, F f) const {
+    return tree_.for_each_span_reverse(lo, hi, f);
+  }
+  template <typename F>
+  bool for_each_span_reverse(F f) const {
+    return tree_.for_each_span_reverse(f);
+  }
+
   // Insertion routines.
   template <typename ValuePointer>
   std::pair<iterator, bool> insert_unique(const key_type &key, ValuePointer value) {
@@ -320,6 +365,10 @@ class safe_btree {
     tree_ = x.tree_;
     return *this;
   }
+  void assign_packed(const self_type &x) {
+    ++generation_;
+    tree_.assign_packed(x.tree_);
+  }
 
   // Deletion routines.
   void erase(const iterator &begin, const iterator &end) {
@@ -384,6 +433,7 @@ class safe_btree {
   }
   double fullness() const { return tree_.fullness(); }
   double overhead() const { return tree_.overhead(); }
+  const stats_type& stats() const { return tree_.stats(); }
 
  private:
   btree_type tree_;
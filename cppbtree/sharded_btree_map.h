@@ -0,0 +1,464 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A sharded_btree_map is a map which may be read and written by many threads
+// at once. It divides the key space into ranges and keeps the values of each
+// range, or shard, in a btree_map of its own guarded by a mutex of its own, so
+// that threads working on different key ranges do not contend:
+//
+//   sharded_btree_map<int64_t, Record> m(16);
+//   m.insert(std::make_pair(key, record));      // Any thread.
+//   Record r;
+//   if (m.find(key, &r)) { ... }                // Any thread.
+//
+// Operations copy values in and out rather than returning iterators or
+// references, which would outlive the lock. update() runs a function on a
+// value with its shard locked instead. scan() visits a range of values in key
+// order, holding one shard's lock at a time; it sees each value which is
+// neither inserted nor erased during the scan exactly once, but is not a
+// snapshot of the map.
+//
+// The boundaries between shards move to keep the shards roughly the same
+// size. A write which leaves its shard holding more than twice the average
+// number of values as of the last rebalance, and more than
+// kMinRebalanceValues, triggers a rebalance; so does calling rebalance().
+// Rebalancing moves values between neighbouring shards, locking two shards at
+// a time, so the map stays usable throughout.
+//
+// A thread finds the shard for a key from an immutable table of the
+// boundaries, which it reads without locking, and then checks the key against
+// the boundaries stored with the shard once the shard is locked. If a
+// rebalance has moved the key to another shard in the meantime, the thread
+// looks again. Each rebalance retires the table it replaces; retired tables
+// are freed when the map is destroyed.
+
+#ifndef UTIL_BTREE_SHARDED_BTREE_MAP_H__
+#define UTIL_BTREE_SHARDED_BTREE_MAP_H__
+
+#include <assert.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "btree_map.h"
+
+namespace btree {
+
+template <typename Key, typename Value,
+          typename Compare = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, Value> >,
+          int TargetNodeSize = 256>
+class sharded_btree_map {
+  typedef sharded_btree_map<Key, Value, Compare, Alloc, TargetNodeSize>
+    self_type;
+
+ public:
+  typedef btree_map<Key, Value, Compare, Alloc, TargetNodeSize> map_type;
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef std::pair<const Key, Value> value_type;
+  typedef Compare key_compare;
+  typedef Alloc allocator_type;
+  typedef typename map_type::size_type size_type;
+
+  enum {
+    // A shard never triggers a rebalance while it holds fewer values.
+    kMinRebalanceValues = 1024,
+  };
+
+ public:
+  // Creates a map of the given number of shards. Every boundary starts out at
+  // key_type(), and the first rebalance spreads them out.
+  explicit sharded_btree_map(int shards,
+                             const key_compare &comp = key_compare(),
+                             const allocator_type &alloc = allocator_type())
+      : comp_(comp),
+        rebalance_limit_(kMinRebalanceValues) {
+    assert(shards > 0);
+    init(std::vector<key_type>(shards - 1, key_type()), alloc);
+  }
+
+  // Creates a map whose shards initially divide the key space at the sorted
+  // boundaries: shard i holds the keys in [boundaries[i-1], boundaries[i]).
+  explicit sharded_btree_map(const std::vector<key_type> &boundaries,
+                             const key_compare &comp = key_compare(),
+                             const allocator_type &alloc = allocator_type())
+      : comp_(comp),
+        rebalance_limit_(kMinRebalanceValues) {
+    init(boundaries, alloc);
+  }
+
+  ~sharded_btree_map() {
+    delete layout_.load();
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      delete retired_[i];
+    }
+  }
+
+  // Inserts x if its key is not present. Returns true if x was inserted.
+  bool insert(const value_type &x) {
+    size_type shard_size;
+    bool inserted;
+    {
+      std::unique_lock<std::mutex> lock;
+      shard &s = *shards_[lock_shard(x.first, &lock)];
+      inserted = s.map.insert(x).second;
+      shard_size = s.map.size();
+    }
+    maybe_rebalance(shard_size);
+    return inserted;
+  }
+
+  // Inserts the value v for the key k, or assigns v to the present value.
+  // Returns true if the value was inserted.
+  bool insert_or_assign(const key_type &k, const mapped_type &v) {
+    size_type shard_size;
+    bool inserted;
+    {
+      std::unique_lock<std::mutex> lock;
+      shard &s = *shards_[lock_shard(k, &lock)];
+      std::pair<typename map_type::iterator, bool> res =
+        s.map.insert(value_type(k, v));
+      if (!res.second) {
+        res.first->second = v;
+      }
+      inserted = res.second;
+      shard_size = s.map.size();
+    }
+    maybe_rebalance(shard_size);
+    return inserted;
+  }
+
+  // Copies the value for the key k to *v if k is present. Returns true if k
+  // is present.
+  bool find(const key_type &k, mapped_type *v) const {
+    std::unique_lock<std::mutex> lock;
+    const shard &s = *shards_[lock_shard(k, &lock)];
+    typename map_type::const_iterator iter = s.map.find(k);
+    if (iter == s.map.end()) {
+      return false;
+    }
+    *v = iter->second;
+    return true;
+  }
+
+  size_type count(const key_type &k) const {
+    std::unique_lock<std::mutex> lock;
+    return shards_[lock_shard(k, &lock)]->map.count(k);
+  }
+
+  // Calls f(&v) for the value v of the key k with its shard locked, if k is
+  // present. Returns true if k is present. f must not use the map.
+  template <typename F>
+  bool update(const key_type &k, F f) {
+    std::unique_lock<std::mutex> lock;
+    shard &s = *shards_[lock_shard(k, &lock)];
+    typename map_type::iterator iter = s.map.find(k);
+    if (iter == s.map.end()) {
+      return false;
+    }
+    f(&iter->second);
+    return true;
+  }
+
+  // Erases the key k. Returns the number of values erased.
+  size_type erase(const key_type &k) {
+    std::unique_lock<std::mutex> lock;
+    return shards_[lock_shard(k, &lock)]->map.erase(k);
+  }
+
+  // Calls f(x) for each value x whose key is in [lo, hi), in key order, until
+  // f returns false. f is called with the value's shard locked and must not
+  // use the map. Returns true if f never returned false.
+  template <typename F>
+  bool scan(const key_type &lo, const key_type &hi, F f) const {
+    return internal_scan(&lo, &hi, f);
+  }
+  // Calls f(x) for each value x in the map. See scan(lo, hi, f).
+  template <typename F>
+  bool scan(F f) const {
+    return internal_scan(NULL, NULL, f);
+  }
+
+  // Erases every value. The shard boundaries are unchanged.
+  void clear() {
+    for (int i = 0; i < shards(); ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i]->mu);
+      shards_[i]->map.clear();
+    }
+  }
+
+  // Moves the shard boundaries so that the shards hold the same number of
+  // values, or as near as one pass over the shards in each direction allows.
+  void rebalance() {
+    std::lock_guard<std::mutex> lock(rebalance_mu_);
+    internal_rebalance();
+  }
+
+  // The number of values in the map. The shards are counted one at a time, so
+  // the count may not reflect any single moment if the map is being written.
+  size_type size() const {
+    size_type n = 0;
+    for (int i = 0; i < shards(); ++i) {
+      n += shard_size(i);
+    }
+    return n;
+  }
+  bool empty() const { return size() == 0; }
+
+  int shards() const { return shard_count_; }
+  // The number of values in shard i.
+  size_type shard_size(int i) const {
+    std::lock_guard<std::mutex> lock(shards_[i]->mu);
+    return shards_[i]->map.size();
+  }
+  // The current boundaries between the shards.
+  std::vector<key_type> boundaries() const {
+    return layout_.load(std::memory_order_acquire)->boundaries;
+  }
+
+  // Verifies that each shard holds only the keys within its boundaries.
+  void verify() const {
+    for (int i = 0; i < shards(); ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i]->mu);
+      const map_type &m = shards_[i]->map;
+      m.verify();
+      if (!m.empty()) {
+        assert(contains(i, m.begin()->first));
+        assert(contains(i, m.rbegin()->first));
+      }
+    }
+  }
+
+ private:
+  struct shard {
+    shard(const key_compare &comp, const allocator_type &alloc)
+        : map(comp, alloc) {
+    }
+
+    mutable std::mutex mu;
+    map_type map;
+    // The boundaries of the shard: it holds the keys in [lo, hi). The first
+    // shard has no lower bound and the last no upper bound. Both are only
+    // changed with the shard locked.
+    key_type lo;
+    key_type hi;
+  };
+
+  // An immutable copy of the shard boundaries, which is replaced whenever a
+  // boundary moves.
+  struct layout {
+    std::vector<key_type> boundaries;
+  };
+
+  void init(const std::vector<key_type> &boundaries,
+            const allocator_type &alloc) {
+    shard_count_ = int(boundaries.size()) + 1;
+    shards_.reset(new std::unique_ptr<shard>[shard_count_]);
+    for (int i = 0; i < shard_count_; ++i) {
+      shards_[i].reset(new shard(typename map_type::key_compare(comp_), alloc));
+      if (i > 0) {
+        shards_[i]->lo = boundaries[i - 1];
+        assert(i == 1 || !comp_(boundaries[i - 1], boundaries[i - 2]));
+      }
+      if (i + 1 < shard_count_) {
+        shards_[i]->hi = boundaries[i];
+      }
+    }
+    layout *l = new layout;
+    l->boundaries = boundaries;
+    layout_.store(l);
+  }
+
+  // Returns true if shard i holds the key k. Requires shard i to be locked.
+  bool contains(int i, const key_type &k) const {
+    const shard &s = *shards_[i];
+    return (i == 0 || !comp_(k, s.lo)) &&
+        (i + 1 == shards() || comp_(k, s.hi));
+  }
+
+  // Locks the shard holding the key k with *lock and returns its index.
+  int lock_shard(const key_type &k, std::unique_lock<std::mutex> *lock) const {
+    for (;;) {
+      const layout *l = layout_.load(std::memory_order_acquire);
+      const int i = int(std::upper_bound(l->boundaries.begin(),
+                                         l->boundaries.end(), k, comp_) -
+                        l->boundaries.begin());
+      std::unique_lock<std::mutex> shard_lock(shards_[i]->mu);
+      if (contains(i, k)) {
+        lock->swap(shard_lock);
+        return i;
+      }
+    }
+  }
+
+  template <typename F>
+  bool internal_scan(const key_type *lo, const key_type *hi, F &f) const {
+    // Each shard after the first is found again from the upper bound of the
+    // previous one, so that values moved by a concurrent rebalance are
+    // neither skipped nor visited twice.
+    std::unique_lock<std::mutex> lock;
+    key_type cursor;
+    bool has_cursor = lo != NULL;
+    int i = 0;
+    if (has_cursor) {
+      cursor = *lo;
+      i = lock_shard(cursor, &lock);
+    } else {
+      std::unique_lock<std::mutex>(shards_[0]->mu).swap(lock);
+    }
+    for (;;) {
+      const shard &s = *shards_[i];
+      typename map_type::const_iterator iter =
+        has_cursor ? s.map.lower_bound(cursor) : s.map.begin();
+      for (; iter != s.map.end(); ++iter) {
+        if (hi != NULL && !comp_(iter->first, *hi)) {
+          return true;
+        }
+        if (!f(*iter)) {
+          return false;
+        }
+      }
+      if (i + 1 == shards() || (hi != NULL && !comp_(s.hi, *hi))) {
+        return true;
+      }
+      cursor = s.hi;
+      has_cursor = true;
+      lock.unlock();
+      i = lock_shard(cursor, &lock);
+    }
+  }
+
+  // Moves shard boundaries if shard_size, the size of a shard just written,
+  // is out of line. Returns immediately if another thread is rebalancing.
+  void maybe_rebalance(size_type shard_size) {
+    if (shard_size <= rebalance_limit_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(rebalance_mu_, std::try_to_lock);
+    if (lock.owns_lock()) {
+      internal_rebalance();
+    }
+  }
+
+  void internal_rebalance();
+
+  // Moves values between shard i and shard i + 1 until shard i, or shard
+  // i + 1 if right is true, holds target values, or as close as the values of
+  // the other shard allow. Requires rebalance_mu_ to be held.
+  void move_boundary(int i, size_type target, bool right);
+
+ private:
+  key_compare comp_;
+  int shard_count_;
+  std::unique_ptr<std::unique_ptr<shard>[]> shards_;
+  std::atomic<const layout*> layout_;
+  // The shard size above which a write triggers a rebalance.
+  std::atomic<size_type> rebalance_limit_;
+  // Serializes rebalancing and guards retired_.
+  std::mutex rebalance_mu_;
+  std::vector<const layout*> retired_;
+
+ private:
+  sharded_btree_map(const self_type&);
+  void operator=(const self_type&);
+};
+
+template <typename K, typename V, typename C, typename A, int N>
+void sharded_btree_map<K, V, C, A, N>::internal_rebalance() {
+  std::vector<size_type> targets(shards());
+  size_type total = 0;
+  for (int i = 0; i < shards(); ++i) {
+    total += shard_size(i);
+  }
+  for (int i = 0; i < shards(); ++i) {
+    targets[i] = total * (i + 1) / shards() - total * i / shards();
+  }
+  // The first pass pushes any surplus towards the last shard and the second
+  // pass evens the shards out from the last shard back.
+  for (int i = 0; i + 1 < shards(); ++i) {
+    move_boundary(i, targets[i], false);
+  }
+  for (int i = shards() - 2; i >= 0; --i) {
+    move_boundary(i, targets[i + 1], true);
+  }
+  rebalance_limit_.store(
+      std::max<size_type>(kMinRebalanceValues, 2 * total / shards()),
+      std::memory_order_relaxed);
+}
+
+template <typename K, typename V, typename C, typename A, int N>
+void sharded_btree_map<K, V, C, A, N>::move_boundary(
+    int i, size_type target, bool right) {
+  typedef typename map_type::iterator iterator;
+  shard &l = *shards_[i];
+  shard &r = *shards_[i + 1];
+  std::lock_guard<std::mutex> left_lock(l.mu);
+  std::lock_guard<std::mutex> right_lock(r.mu);
+
+  const size_type total = l.map.size() + r.map.size();
+  target = std::min(target, total);
+  const size_type left = right ? total - target : target;
+  if (left < l.map.size()) {
+    // Move the last values of shard i to the front of shard i + 1.
+    iterator first = l.map.end();
+    for (size_type n = l.map.size() - left; n > 0; --n) {
+      --first;
+    }
+    iterator hint = r.map.begin();
+    for (iterator iter = l.map.end(); iter != first; ) {
+      hint = r.map.insert(hint, *--iter);
+    }
+    l.hi = first->first;
+    l.map.erase(first, l.map.end());
+  } else if (left > l.map.size()) {
+    // Move the first values of shard i + 1 to the back of shard i. The new
+    // boundary is the first key left in shard i + 1, or its upper bound if it
+    // is emptied, so the last shard always keeps a value.
+    size_type n = left - l.map.size();
+    if (n == r.map.size() && i + 2 == shards()) {
+      --n;
+    }
+    if (n == 0) {
+      return;
+    }
+    iterator last = r.map.begin();
+    for (size_type j = 0; j < n; ++j) {
+      l.map.insert(l.map.end(), *last);
+      ++last;
+    }
+    l.hi = last == r.map.end() ? r.hi : last->first;
+    r.map.erase(r.map.begin(), last);
+  } else {
+    return;
+  }
+  r.lo = l.hi;
+
+  // Publish the new boundary before unlocking the shards, so that a thread
+  // which finds a key missing from the shard it locked sees the new layout.
+  const layout *old = layout_.load(std::memory_order_relaxed);
+  layout *updated = new layout(*old);
+  updated->boundaries[i] = l.hi;
+  layout_.store(updated, std::memory_order_release);
+  retired_.push_back(old);
+}
+
+} // namespace btree
+
+#endif  // UTIL_BTREE_SHARDED_BTREE_MAP_H__
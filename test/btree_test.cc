@@ -12,9 +12,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <random>
+#include <thread>
+
 #include "gtest/gtest.h"
+#include "cppbtree/btree_bitpacked_set.h"
 #include "cppbtree/btree_map.h"
+#include "cppbtree/btree_node_arena.h"
 #include "cppbtree/btree_set.h"
+#include "cppbtree/sharded_btree_map.h"
 #include "btree_test.h"
 
 namespace btree {
@@ -266,5 +272,1084 @@ TEST(Btree, RangeCtorSanity) {
   EXPECT_EQ(1, tmap.size());
 }
 
+template <typename T>
+void FingerSearchTest(const T &t, int32_t max_key) {
+  std::mt19937 rng(11);
+  std::vector<typename T::const_iterator> hints;
+  for (typename T::const_iterator it = t.begin(); it != t.end(); ++it) {
+    hints.push_back(it);
+  }
+  hints.push_back(t.end());
+  for (int i = 0; i < 20000; ++i) {
+    typename T::const_iterator hint = hints[rng() % hints.size()];
+    int32_t key = rng() % (max_key + 20) - 10;
+    EXPECT_TRUE(t.lower_bound(hint, key) == t.lower_bound(key))
+        << "key=" << key;
+    EXPECT_TRUE(t.find(hint, key) == t.find(key)) << "key=" << key;
+  }
+}
+
+TEST(Btree, FingerSearch) {
+  typedef btree_set<int32_t, std::less<int32_t>,
+                    std::allocator<int32_t>, 64> test_set;
+  typedef btree_multiset<int32_t, std::less<int32_t>,
+                         std::allocator<int32_t>, 64> test_mset;
+  test_set s;
+  test_mset ms;
+  std::mt19937 rng(5);
+  for (int i = 0; i < 10000; ++i) {
+    int32_t v = rng() % 5000;
+    s.insert(2 * v);
+    ms.insert(v / 4);
+  }
+  FingerSearchTest(s, 10000);
+  FingerSearchTest(ms, 1250);
+
+  // Hinted insertion far from the hint falls back to the finger search.
+  test_set s2;
+  std::set<int32_t> expected;
+  test_set::iterator hint = s2.end();
+  for (int i = 0; i < 10000; ++i) {
+    int32_t v = rng() % 5000;
+    hint = s2.insert(hint, v);
+    EXPECT_EQ(v, *hint);
+    expected.insert(v);
+  }
+  s2.verify();
+  EXPECT_TRUE(std::equal(s2.begin(), s2.end(), expected.begin()));
+  EXPECT_EQ(expected.size(), s2.size());
+}
+
+template <typename K>
+struct HotLeafSetParams
+    : public btree_set_params<K, std::less<K>, std::allocator<K>, 256> {
+  typedef std::true_type use_hot_leaf_cache;
+};
+
+template <typename K>
+void HotLeafCacheTest() {
+  typedef btree_unique_container<btree<HotLeafSetParams<K> > > test_set;
+  ASSERT_EQ(sizeof(test_set), 2 * sizeof(void*));
+  BtreeTest<test_set, std::set<K> >();
+}
+
+TEST(Btree, HotLeafCache_int32)  { HotLeafCacheTest<int32_t>(); }
+TEST(Btree, HotLeafCache_string) { HotLeafCacheTest<std::string>(); }
+
+TEST(Btree, HotLeafCacheClustered) {
+  // Lookups and inserts which wander slowly through the key space, mostly
+  // hitting the cached leaf, interleaved with erases which merge leaves.
+  typedef btree_unique_container<btree<HotLeafSetParams<int32_t> > > test_set;
+  test_set s;
+  std::set<int32_t> expected;
+  std::mt19937 rng(3);
+  int32_t center = 0;
+  for (int i = 0; i < 100000; ++i) {
+    center += rng() % 7 - 3;
+    int32_t v = center + rng() % 64;
+    switch (rng() % 4) {
+      case 0:
+        EXPECT_EQ(expected.insert(v).second, s.insert(v).second);
+        break;
+      case 1:
+        EXPECT_EQ(expected.erase(v), s.erase(v));
+        break;
+      default:
+        EXPECT_EQ(expected.count(v), s.count(v));
+        break;
+    }
+  }
+  s.verify();
+  EXPECT_EQ(expected.size(), s.size());
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), expected.begin()));
+}
+
+btree_node_arena* TestArena() {
+  static btree_node_arena arena(256 << 20);
+  return &arena;
+}
+
+// A default constructible allocator using TestArena(), for use with the
+// generic container tests.
+template <typename T>
+struct TestArenaAllocator : public btree_arena_allocator<T> {
+  TestArenaAllocator() : btree_arena_allocator<T>(TestArena()) {}
+};
+
+template <typename K>
+struct CompressedSetParams
+    : public btree_compressed_node_params<btree_set_params<
+        K, std::less<K>, TestArenaAllocator<K>, 256> > {
+};
+
+template <typename K>
+struct CompressedMapParams
+    : public btree_compressed_node_params<btree_map_params<
+        K, K, std::less<K>, TestArenaAllocator<K>, 256> > {
+};
+
+template <typename K>
+void CompressedNodeTest() {
+  typedef btree_unique_container<btree<CompressedSetParams<K> > > test_set;
+  typedef btree_map_container<btree<CompressedMapParams<K> > > test_map;
+  typedef btree_multi_container<btree<CompressedSetParams<K> > > test_mset;
+  BtreeTest<test_set, std::set<K> >();
+  BtreeTest<test_map, std::map<K, K> >();
+  BtreeMultiTest<test_mset, std::multiset<K> >();
+
+  // Compressed nodes hold at least as many values and internal nodes are
+  // smaller.
+  typedef btree_set<K, std::less<K>, std::allocator<K>, 256> plain_set;
+  test_set compressed;
+  plain_set plain;
+  for (int i = 0; i < 100000; ++i) {
+    compressed.insert(Generator<K>(100000)(i));
+    plain.insert(Generator<K>(100000)(i));
+  }
+  EXPECT_LE(compressed.nodes(), plain.nodes());
+  EXPECT_LT(compressed.bytes_used(), plain.bytes_used());
+}
+
+TEST(Btree, CompressedNodes_int32)  { CompressedNodeTest<int32_t>(); }
+TEST(Btree, CompressedNodes_string) { CompressedNodeTest<std::string>(); }
+
+TEST(Btree, NodeArena) {
+  typedef btree_compressed_node_params<btree_set_params<
+    int32_t, std::less<int32_t>, btree_arena_allocator<int32_t>, 256> >
+    params_type;
+  typedef btree_unique_container<btree<params_type> > test_set;
+
+  // The arena reuses the blocks of deleted nodes.
+  btree_node_arena arena(1 << 20);
+  {
+    btree_arena_allocator<int32_t> alloc(&arena);
+    test_set s(params_type::key_compare(std::less<int32_t>()), alloc);
+    for (int i = 0; i < 10000; ++i) {
+      s.insert(i);
+    }
+    EXPECT_GT(arena.bytes_used(), 10000 * sizeof(int32_t));
+    size_t reserved = arena.bytes_reserved();
+    s.clear();
+    EXPECT_EQ(0, arena.bytes_used());
+    for (int i = 0; i < 10000; ++i) {
+      s.insert(i);
+    }
+    EXPECT_EQ(reserved, arena.bytes_reserved());
+  }
+  EXPECT_EQ(0, arena.bytes_used());
+
+  // A caller-supplied region, too small for the values inserted.
+  std::vector<max_align_t> region(4096 / sizeof(max_align_t));
+  btree_node_arena small(&region[0], 4096);
+  btree_arena_allocator<int32_t> small_alloc(&small);
+  test_set s(params_type::key_compare(std::less<int32_t>()), small_alloc);
+  bool exhausted = false;
+  try {
+    for (int i = 0; i < 10000; ++i) {
+      s.insert(i);
+    }
+  } catch (const std::bad_alloc&) {
+    exhausted = true;
+  }
+  EXPECT_TRUE(exhausted);
+  EXPECT_LE(small.bytes_reserved(), small.capacity());
+}
+
+TEST(Btree, RelocatableMap) {
+  typedef btree_relocatable_params<btree_map_params<
+    int64_t, int64_t, std::less<int64_t>, btree_arena_allocator<int64_t>,
+    256> > params_type;
+  typedef btree_map_container<btree<params_type> > shared_map;
+  typedef std::map<int64_t, int64_t> checker_map;
+  const size_t kCapacity = 4 << 20;
+
+  // The writer builds the map in a region, with the map object itself among
+  // its nodes.
+  std::vector<max_align_t> region(kCapacity / sizeof(max_align_t));
+  btree_node_arena arena(&region[0], kCapacity);
+  btree_arena_allocator<int64_t> alloc(&arena);
+  shared_map *m = new (arena.allocate(sizeof(shared_map))) shared_map(
+      shared_map::key_compare(), alloc);
+  arena.set_root_object(m);
+  checker_map expected;
+  std::mt19937 rng(43);
+  for (int i = 0; i < 50000; ++i) {
+    int64_t k = rng() % 100000;
+    if (rng() % 4 == 0) {
+      EXPECT_EQ(expected.erase(k), m->erase(k));
+    } else {
+      (*m)[k] = i;
+      expected[k] = i;
+    }
+  }
+  m->verify();
+
+  // A reader sees the region at another address, as another process which
+  // maps it would.
+  for (int pass = 0; pass < 2; ++pass) {
+    std::vector<max_align_t> copy(region);
+    btree_node_arena reader(&copy[0], kCapacity, btree_node_arena::kAttach);
+    const shared_map *r = static_cast<const shared_map*>(reader.root_object());
+    ASSERT_TRUE(r != NULL);
+    EXPECT_EQ(static_cast<void*>(&copy[0]),
+              static_cast<const void*>(
+                  reinterpret_cast<const char*>(r) -
+                  (reinterpret_cast<char*>(m) -
+                   reinterpret_cast<char*>(&region[0]))));
+    r->verify();
+    EXPECT_EQ(expected.size(), r->size());
+    EXPECT_TRUE(std::equal(r->begin(), r->end(), expected.begin()));
+    EXPECT_TRUE(std::equal(r->rbegin(), r->rend(), expected.rbegin()));
+    for (int i = 0; i < 1000; ++i) {
+      int64_t k = rng() % 100000;
+      EXPECT_EQ(expected.count(k), r->count(k));
+      if (expected.lower_bound(k) != expected.end()) {
+        EXPECT_EQ(expected.lower_bound(k)->first, r->lower_bound(k)->first);
+      }
+    }
+
+    // The writer goes on updating the map; the next copy sees the update.
+    for (int i = 0; i < 10000; ++i) {
+      m->erase(m->begin());
+      expected.erase(expected.begin());
+    }
+    shared_map *other = new (arena.allocate(sizeof(shared_map))) shared_map(
+        shared_map::key_compare(), alloc);
+    other->insert(std::make_pair(int64_t(-1), int64_t(-1)));
+    other->swap(*m);
+    other->swap(*m);
+    EXPECT_EQ(1, other->size());
+    other->~shared_map();
+    arena.deallocate(other, sizeof(shared_map));
+  }
+
+  m->~shared_map();
+  arena.deallocate(m, sizeof(shared_map));
+  arena.set_root_object(NULL);
+  EXPECT_EQ(0, arena.bytes_used());
+}
+
+// An order-sensitive summary: the polynomial hash of the sequence of values.
+struct SequenceHashSummary {
+  typedef std::pair<uint64_t, uint64_t> result_type;  // (hash, 31^length)
+  static result_type identity() { return result_type(0, 1); }
+  static result_type value(int32_t v) { return result_type(v, 31); }
+  static result_type combine(const result_type &a, const result_type &b) {
+    return result_type(a.first * b.second + b.first, a.second * b.second);
+  }
+};
+
+struct SummarySetParams
+    : public btree_set_params<int32_t, std::less<int32_t>,
+                              std::allocator<int32_t>, 64> {
+  typedef SequenceHashSummary summary_type;
+};
+
+struct SummaryMapParams
+    : public btree_map_params<int32_t, int64_t, std::less<int32_t>,
+                              std::allocator<int32_t>, 64> {
+  typedef btree_sum_summary<int64_t> summary_type;
+};
+
+template <typename Iter>
+SequenceHashSummary::result_type SequenceHash(Iter b, Iter e) {
+  SequenceHashSummary::result_type res = SequenceHashSummary::identity();
+  for (; b != e; ++b) {
+    res = SequenceHashSummary::combine(res, SequenceHashSummary::value(*b));
+  }
+  return res;
+}
+
+TEST(Btree, AggregateMultiset) {
+  typedef btree_multi_container<btree<SummarySetParams> > SummarySet;
+  SummarySet s;
+  std::multiset<int32_t> m;
+  EXPECT_TRUE(s.aggregate() == SequenceHashSummary::identity());
+
+  std::mt19937 rng(7);
+  for (int i = 0; i < 20000; ++i) {
+    int32_t v = rng() % 2000;
+    if (rng() % 3 == 0) {
+      s.erase(v);
+      m.erase(v);
+    } else {
+      s.insert(v);
+      m.insert(v);
+    }
+    if (i % 97 == 0) {
+      int32_t lo = rng() % 2100 - 50;
+      int32_t hi = rng() % 2100 - 50;
+      EXPECT_TRUE(s.aggregate(lo, hi) ==
+                  (lo < hi ? SequenceHash(m.lower_bound(lo), m.lower_bound(hi))
+                           : SequenceHashSummary::identity()))
+          << "lo=" << lo << " hi=" << hi;
+      EXPECT_TRUE(s.aggregate() == SequenceHash(m.begin(), m.end()));
+    }
+  }
+
+  SummarySet copy(s);
+  EXPECT_TRUE(copy.aggregate(100, 1000) ==
+              SequenceHash(m.lower_bound(100), m.lower_bound(1000)));
+  SummarySet empty;
+  copy.swap(empty);
+  EXPECT_TRUE(copy.aggregate() == SequenceHashSummary::identity());
+  EXPECT_TRUE(empty.aggregate() == SequenceHash(m.begin(), m.end()));
+}
+
+TEST(Btree, AggregateMapSum) {
+  typedef btree_map_container<btree<SummaryMapParams> > SummaryMap;
+  SummaryMap s;
+  std::map<int32_t, int64_t> m;
+  for (int i = 0; i < 5000; ++i) {
+    s.insert(std::make_pair(i, int64_t(i) * 3));
+    m[i] = int64_t(i) * 3;
+  }
+  for (int i = 0; i < 5000; i += 7) {
+    s.erase(i);
+    m.erase(i);
+  }
+  for (int lo = -10; lo < 5010; lo += 331) {
+    for (int hi = lo; hi < 5010; hi += 173) {
+      int64_t expected = 0;
+      for (std::map<int32_t, int64_t>::const_iterator it = m.lower_bound(lo);
+           it != m.lower_bound(hi); ++it) {
+        expected += it->second;
+      }
+      EXPECT_EQ(expected, s.aggregate(lo, hi)) << "lo=" << lo << " hi=" << hi;
+    }
+  }
+
+  // Modifying a mapped value in place requires refreshing the summary.
+  SummaryMap::iterator it = s.find(4001);
+  it->second += 1000;
+  s.update_summary(it);
+  m[4001] += 1000;
+  int64_t total = 0;
+  for (std::map<int32_t, int64_t>::const_iterator it = m.begin();
+       it != m.end(); ++it) {
+    total += it->second;
+  }
+  EXPECT_EQ(total, s.aggregate());
+}
+
+template <typename K, typename Compare, int N>
+struct InterpolationSetParams
+    : public btree_interpolation_search_params<
+        btree_set_params<K, Compare, std::allocator<K>, N> > {
+};
+
+TEST(Btree, InterpolationSearch_int32) {
+  typedef btree_unique_container<btree<
+    InterpolationSetParams<int32_t, std::less<int32_t>, 2048> > > test_set;
+  BtreeTest<test_set, std::set<int32_t> >();
+}
+
+TEST(Btree, InterpolationSearch_double) {
+  typedef btree_unique_container<btree<
+    InterpolationSetParams<double, std::less<double>, 1024> > > test_set;
+  BtreeTest<test_set, std::set<double> >();
+}
+
+TEST(Btree, InterpolationSearch_multiset_int64) {
+  typedef btree_multi_container<btree<
+    InterpolationSetParams<int64_t, std::less<int64_t>, 2048> > > test_set;
+  BtreeMultiTest<test_set, std::multiset<int64_t> >();
+}
+
+template <typename T, typename C>
+void InterpolationLookupTest(const std::vector<typename T::key_type> &keys) {
+  T s(keys.begin(), keys.end());
+  C expected(keys.begin(), keys.end());
+  s.verify();
+  for (typename C::const_iterator it = expected.begin(); it != expected.end();
+       ++it) {
+    EXPECT_EQ(*it, *s.find(*it));
+    if (expected.upper_bound(*it) == expected.end()) {
+      EXPECT_TRUE(s.upper_bound(*it) == s.end());
+    } else {
+      EXPECT_EQ(*expected.upper_bound(*it), *s.upper_bound(*it));
+    }
+  }
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), expected.begin()));
+}
+
+TEST(Btree, InterpolationSearchSkewed) {
+  // Keys far from uniform, in both orders, are still found.
+  typedef std::numeric_limits<int64_t> limits;
+  std::vector<int64_t> keys;
+  std::mt19937 rng(31);
+  for (int i = 0; i < 20000; ++i) {
+    keys.push_back(int64_t(1) << (rng() % 62));
+    keys.push_back(-int64_t(rng() % 1000));
+  }
+  keys.push_back(limits::min());
+  keys.push_back(limits::max());
+
+  typedef btree_unique_container<btree<
+    InterpolationSetParams<int64_t, std::less<int64_t>, 1024> > > less_set;
+  typedef btree_unique_container<btree<
+    InterpolationSetParams<int64_t, std::greater<int64_t>, 1024> > >
+    greater_set;
+  InterpolationLookupTest<less_set, std::set<int64_t> >(keys);
+  InterpolationLookupTest<greater_set,
+                          std::set<int64_t, std::greater<int64_t> > >(keys);
+
+  typedef btree_unique_container<btree<
+    InterpolationSetParams<double, std::less<double>, 1024> > > double_set;
+  double_set d;
+  d.insert(-std::numeric_limits<double>::infinity());
+  d.insert(std::numeric_limits<double>::infinity());
+  for (int i = 0; i < 1000; ++i) {
+    d.insert(i * 0.5);
+  }
+  EXPECT_EQ(0.5, *d.upper_bound(0.0));
+  EXPECT_EQ(499.5, *d.lower_bound(499.25));
+  EXPECT_TRUE(d.find(1.25) == d.end());
+}
+
+TEST(Btree, InterpolationSearchComparisons) {
+  // Interpolation finds uniformly spread keys, such as timestamps, in large
+  // nodes with far fewer comparisons than linear search.
+  struct linear_params
+      : public btree_set_params<int64_t, std::less<int64_t>,
+                                std::allocator<int64_t>, 2048> {
+    typedef btree_stats stats_type;
+  };
+  struct interpolation_params
+      : public btree_interpolation_search_params<linear_params> {
+  };
+  typedef btree_unique_container<btree<linear_params> > linear_set;
+  typedef btree_unique_container<btree<interpolation_params> >
+    interpolation_set;
+
+  std::vector<int64_t> keys;
+  std::mt19937 rng(37);
+  int64_t t = 1500000000000;
+  for (int i = 0; i < 100000; ++i) {
+    t += 900 + rng() % 200;
+    keys.push_back(t);
+  }
+  linear_set l(keys.begin(), keys.end());
+  interpolation_set s(keys.begin(), keys.end());
+  int64_t linear_comparisons = l.stats().comparisons;
+  int64_t interpolation_comparisons = s.stats().comparisons;
+  for (int i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(keys[i], *s.find(keys[i]));
+    l.find(keys[i]);
+  }
+  linear_comparisons = l.stats().comparisons - linear_comparisons;
+  interpolation_comparisons =
+    s.stats().comparisons - interpolation_comparisons;
+  EXPECT_LT(interpolation_comparisons * 10, linear_comparisons);
+}
+
+template <typename K>
+struct StatsSetParams
+    : public btree_set_params<K, std::less<K>, std::allocator<K>, 256> {
+  typedef btree_stats stats_type;
+};
+
+template <typename K>
+void StatsTest() {
+  typedef btree_unique_container<btree<StatsSetParams<K> > > test_set;
+  BtreeTest<test_set, std::set<K> >();
+}
+
+TEST(Btree, Stats_int32)  { StatsTest<int32_t>(); }
+TEST(Btree, Stats_string) { StatsTest<std::string>(); }
+
+TEST(Btree, StatsCounts) {
+  typedef btree_unique_container<btree<StatsSetParams<int32_t> > > test_set;
+  typedef btree_unique_container<btree<btree_set_params<
+    int32_t, std::less<int32_t>, std::allocator<int32_t>, 256> > > plain_set;
+  // Without a stats policy the counters take no space.
+  EXPECT_EQ(sizeof(plain_set), sizeof(void*));
+
+  test_set s;
+  std::mt19937 rng(5);
+  for (int i = 0; i < 20000; ++i) {
+    s.insert(rng() % 100000);
+  }
+  const btree_stats &stats = s.stats();
+  EXPECT_GT(stats.splits, 0);
+  EXPECT_GT(stats.rebalances_left_to_right + stats.rebalances_right_to_left,
+            0);
+  EXPECT_EQ(stats.node_allocations - stats.node_frees, s.nodes());
+  EXPECT_GE(stats.comparisons, stats.descents);
+  EXPECT_EQ(0, stats.merges);
+  EXPECT_GE(stats.average_descent_depth(), 1.0);
+  EXPECT_LE(stats.average_descent_depth(), double(s.height()));
+
+  int64_t descents = stats.descents;
+  s.find(17);
+  s.lower_bound(17);
+  s.upper_bound(17);
+  EXPECT_EQ(descents + 3, stats.descents);
+
+  // A copy only counts the work done building it.
+  test_set copy(s);
+  EXPECT_EQ(copy.stats().node_allocations - copy.stats().node_frees,
+            copy.nodes());
+  EXPECT_EQ(0, copy.stats().merges);
+
+  while (!s.empty()) {
+    s.erase(s.begin());
+  }
+  EXPECT_GT(stats.merges, 0);
+  EXPECT_GT(stats.shrinks, 0);
+  EXPECT_EQ(stats.node_allocations, stats.node_frees);
+}
+
+template <typename T>
+void CopyTest(T *src) {
+  // A copy mirrors the structure of its source.
+  T copy(*src);
+  copy.verify();
+  EXPECT_TRUE(copy == *src);
+  EXPECT_EQ(src->height(), copy.height());
+  EXPECT_EQ(src->leaf_nodes(), copy.leaf_nodes());
+  EXPECT_EQ(src->internal_nodes(), copy.internal_nodes());
+  EXPECT_EQ(src->aggregate(), copy.aggregate());
+
+  // A packed copy holds the same values in no more nodes.
+  T packed;
+  packed.assign_packed(*src);
+  packed.verify();
+  EXPECT_TRUE(packed == *src);
+  EXPECT_LE(packed.height(), src->height());
+  EXPECT_LE(packed.nodes(), src->nodes());
+  EXPECT_EQ(src->aggregate(), packed.aggregate());
+  EXPECT_EQ(packed.stats().node_allocations, packed.nodes());
+
+  // Both remain usable after the copy.
+  for (typename T::iterator it = packed.begin(); it != packed.end();) {
+    it = packed.erase(it);
+    if (it != packed.end()) {
+      ++it;
+    }
+  }
+  packed.verify();
+  EXPECT_EQ(src->size() / 2, packed.size());
+  EXPECT_EQ(packed.aggregate(), packed.size());
+  copy.insert(copy.end(), *src->begin());
+  copy.verify();
+
+  // Repacking in place.
+  src->assign_packed(*src);
+  src->verify();
+  EXPECT_EQ(src->size() + 1, copy.size());
+}
+
+template <typename K>
+struct CopySetParams
+    : public btree_set_params<K, std::less<K>, std::allocator<K>, 256> {
+  typedef btree_count_summary summary_type;
+  typedef btree_stats stats_type;
+};
+
+template <typename K>
+void CopyTests() {
+  typedef btree_multi_container<btree<CopySetParams<K> > > test_set;
+  std::mt19937 rng(11);
+  for (int n = 1; n < 5000; n = n * 3 / 2 + 1) {
+    test_set s;
+    for (int i = 0; i < n; ++i) {
+      s.insert(Generator<K>(n)(rng() % n));
+    }
+    CopyTest(&s);
+  }
+  test_set empty;
+  test_set packed;
+  packed.assign_packed(empty);
+  EXPECT_EQ(0, packed.size());
+  EXPECT_EQ(0, packed.nodes());
+}
+
+TEST(Btree, Copy_int32)  { CopyTests<int32_t>(); }
+TEST(Btree, Copy_string) { CopyTests<std::string>(); }
+
+TEST(Btree, CopyPackedFullness) {
+  typedef btree_unique_container<btree<CopySetParams<int64_t> > > test_set;
+  test_set s;
+  std::mt19937 rng(13);
+  while (s.size() < 100000) {
+    s.insert(rng());
+  }
+  test_set packed;
+  packed.assign_packed(s);
+  EXPECT_LT(s.fullness(), 0.9);
+  EXPECT_GT(packed.fullness(), 0.95);
+}
+
+template <typename K, int N>
+struct InlineSetParams
+    : public btree_inline_params<
+        btree_set_params<K, std::less<K>, std::allocator<K>, 256>, N> {
+  typedef btree_stats stats_type;
+};
+
+template <typename K, int N>
+void InlineRootTest() {
+  typedef btree_unique_container<btree<InlineSetParams<K, N> > > test_set;
+  BtreeTest<test_set, std::set<K> >();
+}
+
+TEST(Btree, InlineRoot_int32)  { InlineRootTest<int32_t, 8>(); }
+TEST(Btree, InlineRoot_string) { InlineRootTest<std::string, 4>(); }
+
+TEST(Btree, InlineRootSmall) {
+  typedef btree_unique_container<btree<InlineSetParams<int32_t, 8> > >
+    test_set;
+  // Up to 8 values are held without allocating.
+  test_set a;
+  for (int i = 0; i < 8; ++i) {
+    a.insert(i);
+  }
+  EXPECT_EQ(0, a.stats().node_allocations);
+  EXPECT_EQ(sizeof(a), a.bytes_used());
+  a.insert(8);
+  EXPECT_EQ(1, a.stats().node_allocations);
+  EXPECT_EQ(9, a.size());
+  a.verify();
+  while (!a.empty()) {
+    a.erase(a.begin());
+  }
+  a.insert(42);
+  EXPECT_EQ(1, a.stats().node_allocations);
+  EXPECT_EQ(1, a.stats().node_frees);
+
+  // Swapping btrees moves inline values between the buffers.
+  test_set b, c, d;
+  b.insert(1);
+  b.insert(2);
+  for (int i = 100; i < 200; ++i) {
+    c.insert(i);
+  }
+  a.swap(b);
+  EXPECT_EQ(2, a.size());
+  EXPECT_EQ(1, *a.begin());
+  EXPECT_EQ(42, *b.begin());
+  a.swap(c);
+  EXPECT_EQ(100, a.size());
+  EXPECT_EQ(2, c.size());
+  EXPECT_EQ(2, *c.rbegin());
+  c.swap(a);
+  a.swap(d);
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(2, d.size());
+  d.insert(3);
+  d.verify();
+  EXPECT_EQ(3, d.size());
+  EXPECT_EQ(3, *d.rbegin());
+  c.verify();
+  EXPECT_EQ(100, c.size());
+
+  // Copies of a small btree are held inline as well.
+  test_set e(d);
+  EXPECT_EQ(0, e.stats().node_allocations);
+  EXPECT_TRUE(e == d);
+}
+
+// Collects the values of the spans passed to it, stopping after limit values.
+template <typename V>
+struct SpanCollector {
+  SpanCollector(std::vector<V> *v, int l)
+      : values(v),
+        limit(l) {
+  }
+  bool operator()(const V *begin, const V *end) {
+    EXPECT_LT(begin, end);
+    values->insert(values->end(), begin, end);
+    return values->size() < limit;
+  }
+  std::vector<V> *values;
+  size_t limit;
+};
+
+struct SpanSum {
+  SpanSum(double *s) : sum(s) {}
+  bool operator()(const std::pair<const int64_t, double> *begin,
+                  const std::pair<const int64_t, double> *end) {
+    for (; begin != end; ++begin) {
+      *sum += begin->second;
+    }
+    return true;
+  }
+  double *sum;
+};
+
+TEST(Btree, ForEachSpan) {
+  typedef btree_multiset<int32_t, std::less<int32_t>,
+                         std::allocator<int32_t>, 256> test_set;
+  test_set s;
+  EXPECT_TRUE(s.for_each_span(SpanCollector<int32_t>(NULL, 0)));
+  std::mt19937 rng(17);
+  for (int i = 0; i < 20000; ++i) {
+    s.insert(rng() % 10000);
+  }
+  for (int lo = -5; lo < 10005; lo += 997) {
+    for (int hi = lo - 1; hi < 10005; hi += 1511) {
+      std::vector<int32_t> expected;
+      if (lo < hi) {
+        expected.assign(s.lower_bound(lo), s.lower_bound(hi));
+      }
+      std::vector<int32_t> forward, reverse;
+      EXPECT_TRUE(s.for_each_span(
+          lo, hi, SpanCollector<int32_t>(&forward, s.size() + 1)));
+      EXPECT_EQ(expected, forward);
+      EXPECT_TRUE(s.for_each_span_reverse(
+          lo, hi, SpanCollector<int32_t>(&reverse, s.size() + 1)));
+      // The runs come in reverse order but each run is ascending.
+      std::sort(reverse.begin(), reverse.end());
+      EXPECT_EQ(expected, reverse);
+    }
+  }
+
+  // Every value is visited exactly once, and the visit stops when asked.
+  std::vector<int32_t> all, some;
+  EXPECT_TRUE(s.for_each_span(SpanCollector<int32_t>(&all, s.size() + 1)));
+  EXPECT_TRUE(std::equal(all.begin(), all.end(), s.begin()));
+  EXPECT_EQ(s.size(), all.size());
+  EXPECT_FALSE(s.for_each_span(SpanCollector<int32_t>(&some, 1000)));
+  EXPECT_GE(some.size(), 1000);
+  EXPECT_LT(some.size(), 1000 + s.nodes() * 256);
+  EXPECT_TRUE(std::equal(some.begin(), some.end(), s.begin()));
+  std::vector<int32_t> tail;
+  EXPECT_FALSE(s.for_each_span_reverse(SpanCollector<int32_t>(&tail, 1)));
+  EXPECT_EQ(*s.rbegin(), tail.back());
+}
+
+TEST(Btree, ForEachSpanMapSum) {
+  btree_map<int64_t, double> m;
+  for (int i = 0; i < 10000; ++i) {
+    m[i * 3] = i * 0.5;
+  }
+  double sum = 0;
+  EXPECT_TRUE(m.for_each_span(300, 6000, SpanSum(&sum)));
+  double expected = 0;
+  for (btree_map<int64_t, double>::const_iterator it = m.lower_bound(300);
+       it != m.lower_bound(6000); ++it) {
+    expected += it->second;
+  }
+  EXPECT_EQ(expected, sum);
+}
+
+template <typename K>
+void BitpackedSetTest(K min_value, int spread) {
+  typedef btree_bitpacked_set<K, 16> test_set;
+  std::mt19937 rng(19);
+  std::vector<K> values;
+  for (int i = 0; i < 5000; ++i) {
+    values.push_back(K(min_value + K(rng() % spread)));
+  }
+  test_set s(values.begin(), values.end());
+  std::set<K> expected(values.begin(), values.end());
+  EXPECT_EQ(expected.size(), s.size());
+  EXPECT_EQ(0, s.unpacked_blocks());
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), expected.begin()));
+
+  for (int i = 0; i < 20000; ++i) {
+    K v = K(min_value + K(rng() % spread));
+    switch (rng() % 3) {
+      case 0:
+        EXPECT_EQ(expected.insert(v).second, s.insert(v));
+        break;
+      case 1:
+        EXPECT_EQ(expected.erase(v), s.erase(v));
+        break;
+      default:
+        EXPECT_EQ(expected.count(v), s.count(v));
+        if (expected.lower_bound(v) == expected.end()) {
+          EXPECT_TRUE(s.lower_bound(v) == s.end());
+        } else {
+          EXPECT_EQ(*expected.lower_bound(v), *s.lower_bound(v));
+        }
+        break;
+    }
+  }
+  EXPECT_EQ(expected.size(), s.size());
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), expected.begin()));
+  EXPECT_GT(s.unpacked_blocks(), 0);
+
+  s.compact();
+  EXPECT_EQ(0, s.unpacked_blocks());
+  EXPECT_EQ(expected.size(), s.size());
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), expected.begin()));
+  EXPECT_EQ(expected.size() / 16 + (expected.size() % 16 != 0), s.blocks());
+
+  while (!s.empty()) {
+    EXPECT_EQ(1, s.erase(*s.begin()));
+  }
+  EXPECT_TRUE(s.begin() == s.end());
+  EXPECT_EQ(0, s.blocks());
+}
+
+TEST(Btree, BitpackedSet_int32) { BitpackedSetTest<int32_t>(-3000, 6000); }
+TEST(Btree, BitpackedSet_uint64) {
+  BitpackedSetTest<uint64_t>(uint64_t(1) << 40, 100000);
+}
+TEST(Btree, BitpackedSet_int64_wide) {
+  // Values spanning the whole range need all 64 bits.
+  BitpackedSetTest<int64_t>(std::numeric_limits<int64_t>::min(), 1 << 30);
+  btree_bitpacked_set<int64_t> s;
+  s.insert(std::numeric_limits<int64_t>::min());
+  s.insert(std::numeric_limits<int64_t>::max());
+  s.insert(0);
+  s.compact();
+  EXPECT_TRUE(s.count(std::numeric_limits<int64_t>::max()));
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(), *s.begin());
+}
+
+TEST(Btree, BitpackedSetFootprint) {
+  // Dense IDs take a fraction of the memory of a btree_set.
+  std::mt19937 rng(23);
+  btree_set<uint64_t> ids;
+  uint64_t id = uint64_t(1) << 50;
+  for (int i = 0; i < 100000; ++i) {
+    id += 1 + rng() % 8;
+    ids.insert(id);
+  }
+  btree_bitpacked_set<uint64_t> packed(ids.begin(), ids.end());
+  EXPECT_TRUE(std::equal(packed.begin(), packed.end(), ids.begin()));
+  EXPECT_LT(packed.bytes_used() * 3, ids.bytes_used());
+}
+
+template <typename T>
+void FreezeTest(int n) {
+  typedef typename T::key_type K;
+  typedef typename T::value_type V;
+  const int max_key = 2 * n + 1;
+  std::mt19937 rng(29);
+  Generator<V> value_gen(max_key);
+  T b;
+  for (int i = 0; i < n; ++i) {
+    b.insert(value_gen(2 * (rng() % n) + 1));
+  }
+  typename T::frozen_type f = b.freeze();
+  EXPECT_EQ(b.size(), f.size());
+  EXPECT_EQ(b.empty(), f.empty());
+  EXPECT_TRUE(std::equal(b.begin(), b.end(), f.begin()));
+  EXPECT_TRUE(std::equal(b.rbegin(), b.rend(), f.rbegin()));
+  EXPECT_EQ(b.size(), std::distance(f.rbegin(), f.rend()));
+
+  Generator<K> key_gen(max_key);
+  for (int i = 0; i <= max_key; ++i) {
+    K key = key_gen(i);
+    EXPECT_EQ(b.count(key), f.count(key));
+    EXPECT_EQ(std::distance(b.begin(), b.lower_bound(key)),
+              std::distance(f.begin(), f.lower_bound(key)));
+    EXPECT_EQ(std::distance(b.begin(), b.upper_bound(key)),
+              std::distance(f.begin(), f.upper_bound(key)));
+    if (b.find(key) == b.end()) {
+      EXPECT_TRUE(f.find(key) == f.end());
+    } else {
+      EXPECT_EQ(*b.find(key), *f.find(key));
+    }
+  }
+
+  typename T::frozen_type g;
+  g.swap(f);
+  EXPECT_TRUE(f.empty());
+  EXPECT_TRUE(g == b.freeze());
+}
+
+TEST(Btree, Freeze) {
+  const int sizes[] = { 0, 1, 2, 3, 7, 8, 15, 16, 17, 100, 1000 };
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    FreezeTest<btree_set<int32_t> >(sizes[i]);
+    FreezeTest<btree_set<std::string> >(sizes[i]);
+    FreezeTest<btree_map<int32_t, int32_t> >(sizes[i]);
+    FreezeTest<btree_multiset<int32_t> >(sizes[i]);
+    FreezeTest<btree_multimap<std::string, int32_t> >(sizes[i]);
+  }
+}
+
+TEST(Btree, FreezeFootprint) {
+  btree_set<int32_t> s;
+  for (int i = 0; i < 100000; ++i) {
+    s.insert(i);
+  }
+  btree_set<int32_t>::frozen_type f = s.freeze();
+  EXPECT_LT(f.bytes_used(), s.bytes_used());
+  EXPECT_EQ(100000 * sizeof(int32_t) + sizeof(f), f.bytes_used());
+}
+
+template <typename K, typename V>
+struct ScanCollector {
+  explicit ScanCollector(std::vector<std::pair<K, V> > *v, int limit = -1)
+      : values(v), remaining(limit) {
+  }
+  bool operator()(const std::pair<const K, V> &x) {
+    values->push_back(x);
+    return --remaining != 0;
+  }
+  std::vector<std::pair<K, V> > *values;
+  int remaining;
+};
+
+struct AddTo {
+  explicit AddTo(int64_t d) : delta(d) {}
+  void operator()(int64_t *v) const { *v += delta; }
+  int64_t delta;
+};
+
+TEST(Btree, ShardedMap) {
+  typedef sharded_btree_map<int64_t, int64_t> test_map;
+  typedef std::vector<std::pair<int64_t, int64_t> > value_vector;
+  test_map m(8);
+  std::map<int64_t, int64_t> expected;
+  std::mt19937 rng(41);
+  for (int i = 0; i < 50000; ++i) {
+    // Keys drift upwards, so the shards need rebalancing to stay even.
+    const int64_t k = i + int64_t(rng() % 10000);
+    int64_t v = 0;
+    switch (rng() % 6) {
+      case 0:
+        EXPECT_EQ(expected.insert(std::make_pair(k, i)).second,
+                  m.insert(std::make_pair(k, int64_t(i))));
+        break;
+      case 1:
+        EXPECT_EQ(expected.count(k) == 0, m.insert_or_assign(k, i));
+        expected[k] = i;
+        break;
+      case 2:
+        EXPECT_EQ(expected.erase(k), m.erase(k));
+        break;
+      case 3:
+        if (expected.count(k)) {
+          expected[k] += 3;
+        }
+        EXPECT_EQ(expected.count(k), m.update(k, AddTo(3)));
+        break;
+      default:
+        EXPECT_EQ(expected.count(k), m.count(k));
+        EXPECT_EQ(expected.count(k) != 0, m.find(k, &v));
+        if (expected.count(k)) {
+          EXPECT_EQ(expected[k], v);
+        }
+        break;
+    }
+    if (i % 10000 == 0) {
+      m.verify();
+    }
+  }
+  m.verify();
+  EXPECT_EQ(expected.size(), m.size());
+
+  m.rebalance();
+  m.verify();
+  for (int i = 0; i < m.shards(); ++i) {
+    EXPECT_LE(m.shard_size(i), expected.size() / m.shards() + 1);
+  }
+  std::vector<int64_t> boundaries = m.boundaries();
+  EXPECT_TRUE(std::is_sorted(boundaries.begin(), boundaries.end()));
+
+  value_vector all;
+  EXPECT_TRUE(m.scan(ScanCollector<int64_t, int64_t>(&all)));
+  EXPECT_TRUE(std::equal(all.begin(), all.end(), expected.begin()));
+  EXPECT_EQ(expected.size(), all.size());
+
+  for (int i = 0; i < 100; ++i) {
+    int64_t lo = rng() % 70000, hi = lo + rng() % 20000;
+    value_vector range;
+    EXPECT_TRUE(m.scan(lo, hi, ScanCollector<int64_t, int64_t>(&range)));
+    EXPECT_EQ(std::distance(expected.lower_bound(lo),
+                            expected.lower_bound(hi)),
+              range.size());
+    EXPECT_TRUE(std::equal(range.begin(), range.end(),
+                           expected.lower_bound(lo)));
+  }
+  value_vector first;
+  EXPECT_FALSE(m.scan(ScanCollector<int64_t, int64_t>(&first, 10)));
+  EXPECT_EQ(10, first.size());
+
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_EQ(boundaries, m.boundaries());
+}
+
+TEST(Btree, ShardedMapThreads) {
+  // Writers fill the map concurrently, mostly within their own key ranges,
+  // while the shards rebalance and a reader scans it.
+  typedef sharded_btree_map<int64_t, int64_t> test_map;
+  const int kThreads = 4;
+  const int kValues = 20000;
+  test_map m(std::vector<int64_t>(1, 0));
+  std::atomic<bool> done(false);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < kThreads; ++t) {
+    writers.push_back(std::thread([&m, t] {
+      for (int i = 0; i < kValues; ++i) {
+        const int64_t k = int64_t(i) * kThreads + t;
+        m.insert(std::make_pair(k, k));
+        if (i % 2 == 1) {
+          m.update(k - kThreads, AddTo(1));
+        }
+      }
+    }));
+  }
+  int64_t scans = 0;
+  std::thread reader([&m, &done, &scans] {
+    while (!done.load()) {
+      std::vector<std::pair<int64_t, int64_t> > values;
+      m.scan(ScanCollector<int64_t, int64_t>(&values));
+      for (size_t i = 1; i < values.size(); ++i) {
+        ASSERT_LT(values[i - 1].first, values[i].first);
+      }
+      ++scans;
+    }
+  });
+  for (int t = 0; t < kThreads; ++t) {
+    writers[t].join();
+  }
+  done.store(true);
+  reader.join();
+  EXPECT_GT(scans, 0);
+
+  m.verify();
+  EXPECT_EQ(kThreads * kValues, m.size());
+  for (int64_t k = 0; k < kThreads * kValues; ++k) {
+    int64_t v = -1;
+    EXPECT_TRUE(m.find(k, &v));
+    EXPECT_EQ(k + (k / kThreads % 2 == 0 ? 1 : 0), v);
+  }
+  // The writes rebalanced the shards away from the boundary at 0.
+  EXPECT_GT(m.boundaries()[0], 0);
+}
+
+TEST(Btree, NodeCounts) {
+  // The node counts kept on the root must match the nodes actually live,
+  // which the stats policy tracks independently.
+  typedef btree_unique_container<btree<StatsSetParams<int32_t> > > test_set;
+  test_set s;
+  EXPECT_EQ(0, s.nodes());
+  std::mt19937 rng(7);
+  for (int round = 0; round < 20; ++round) {
+    for (int i = 0; i < 5000; ++i) {
+      int32_t v = rng() % 50000;
+      if (round % 3 == 2) {
+        s.erase(v);
+      } else {
+        s.insert(v);
+      }
+    }
+    const btree_stats &stats = s.stats();
+    EXPECT_EQ(stats.node_allocations - stats.node_frees, s.nodes());
+    EXPECT_EQ(s.nodes(), s.leaf_nodes() + s.internal_nodes());
+    EXPECT_GT(s.leaf_nodes(), s.internal_nodes());
+  }
+  test_set copy(s);
+  EXPECT_EQ(copy.stats().node_allocations - copy.stats().node_frees,
+            copy.nodes());
+  s.clear();
+  EXPECT_EQ(0, s.nodes());
+  s.insert(1);
+  EXPECT_EQ(1, s.leaf_nodes());
+  EXPECT_EQ(0, s.internal_nodes());
+  s.swap(copy);
+  EXPECT_EQ(1, copy.nodes());
+  EXPECT_EQ(s.stats().node_allocations - s.stats().node_frees, s.nodes());
+}
+
 } // namespace
 } // namespace btree
@@ -287,7 +287,7 @@ class base_checker {
 
   void erase(iterator begin, iterator end) {
     int size = tree_.size();
-    int count = distance(begin, end);
+    int count = std::distance(begin, end);
     typename CheckerType::iterator checker_begin = checker_.find(begin.key());
     for (iterator tmp(tree_.find(begin.key())); tmp != begin; ++tmp) {
       ++checker_begin;
@@ -601,12 +601,12 @@ void DoTest(const char *name, T *b, const std::vector<V> &values) {
          name, const_b.fullness(), const_b.overhead(),
          double(const_b.bytes_used()) / const_b.size());
 
-  // Test copy constructor.
+  // Test copy constructor. The copy mirrors the structure of the original.
   T b_copy(const_b);
   EXPECT_EQ(b_copy.size(), const_b.size());
-  EXPECT_LE(b_copy.height(), const_b.height());
-  EXPECT_LE(b_copy.internal_nodes(), const_b.internal_nodes());
-  EXPECT_LE(b_copy.leaf_nodes(), const_b.leaf_nodes());
+  EXPECT_EQ(b_copy.height(), const_b.height());
+  EXPECT_EQ(b_copy.internal_nodes(), const_b.internal_nodes());
+  EXPECT_EQ(b_copy.leaf_nodes(), const_b.leaf_nodes());
   for (int i = 0; i < values.size(); ++i) {
     EXPECT_EQ(*b_copy.find(key_of_value(values[i])), values[i]);
   }
@@ -629,19 +629,20 @@ void DoTest(const char *name, T *b, const std::vector<V> &values) {
   b_range.clear();
   b_range.insert(b_copy.begin(), b_copy.end());
   EXPECT_EQ(b_range.size(), b_copy.size());
-  EXPECT_EQ(b_range.height(), b_copy.height());
-  EXPECT_EQ(b_range.internal_nodes(), b_copy.internal_nodes());
-  EXPECT_EQ(b_range.leaf_nodes(), b_copy.leaf_nodes());
+  EXPECT_LE(b_range.height(), b_copy.height());
+  EXPECT_LE(b_range.internal_nodes(), b_copy.internal_nodes());
+  EXPECT_LE(b_range.leaf_nodes(), b_copy.leaf_nodes());
   for (int i = 0; i < values.size(); ++i) {
     EXPECT_EQ(*b_range.find(key_of_value(values[i])), values[i]);
   }
 
   // Test assignment to self. Nothing should change.
+  T b_range_copy(b_range);
   b_range.operator=(b_range);
-  EXPECT_EQ(b_range.size(), b_copy.size());
-  EXPECT_EQ(b_range.height(), b_copy.height());
-  EXPECT_EQ(b_range.internal_nodes(), b_copy.internal_nodes());
-  EXPECT_EQ(b_range.leaf_nodes(), b_copy.leaf_nodes());
+  EXPECT_EQ(b_range.size(), b_range_copy.size());
+  EXPECT_EQ(b_range.height(), b_range_copy.height());
+  EXPECT_EQ(b_range.internal_nodes(), b_range_copy.internal_nodes());
+  EXPECT_EQ(b_range.leaf_nodes(), b_range_copy.leaf_nodes());
 
   // Test assignment of new values.
   b_range.clear();